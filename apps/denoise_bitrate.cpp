@@ -0,0 +1,212 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * denoise_bitrate.cpp - measure how much the temporal denoise filter saves an H.264 encoder
+ */
+
+// Generates a synthetic YUV420 sequence (a smooth background with a moving square, plus
+// Gaussian noise that is different on every frame), and encodes it with libx264 at a fixed
+// CRF, both as it is and after running it through the same temporal filter that the
+// temporal_denoise stage uses. At a fixed quality the encoder spends the difference in
+// output size on the noise, so the reported reduction is what the stage saves in bitrate.
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavutil/opt.h"
+}
+
+#include "post_processing_stages/pixel_kernel.hpp"
+#include "post_processing_stages/temporal_filter.hpp"
+
+namespace po = boost::program_options;
+
+struct Sequence
+{
+	unsigned int width;
+	unsigned int height;
+	std::vector<std::vector<uint8_t>> frames;
+};
+
+static Sequence make_sequence(unsigned int width, unsigned int height, unsigned int frames, double noise)
+{
+	Sequence seq { width, height, {} };
+	std::mt19937 rng(1234);
+	std::normal_distribution<double> gaussian(0, noise);
+	auto noisy = [&](double value) {
+		return static_cast<uint8_t>(std::clamp(std::lround(value + gaussian(rng)), 0l, 255l));
+	};
+
+	unsigned int y_size = width * height, uv_size = (width / 2) * (height / 2);
+	unsigned int square = height / 4;
+	for (unsigned int i = 0; i < frames; i++)
+	{
+		std::vector<uint8_t> frame(y_size + 2 * uv_size);
+		unsigned int x0 = (i * 4) % (width - square), y0 = height / 2 - square / 2;
+		for (unsigned int y = 0; y < height; y++)
+		{
+			for (unsigned int x = 0; x < width; x++)
+			{
+				bool inside = x >= x0 && x < x0 + square && y >= y0 && y < y0 + square;
+				double value = inside ? 220 : 40 + 120.0 * x / width + 40.0 * y / height;
+				frame[y * width + x] = noisy(value);
+			}
+		}
+		uint8_t *u = frame.data() + y_size, *v = u + uv_size;
+		for (unsigned int y = 0; y < height / 2; y++)
+		{
+			for (unsigned int x = 0; x < width / 2; x++)
+			{
+				u[y * (width / 2) + x] = noisy(128 + 20.0 * x / width);
+				v[y * (width / 2) + x] = noisy(128 - 20.0 * y / height);
+			}
+		}
+		seq.frames.push_back(std::move(frame));
+	}
+
+	return seq;
+}
+
+// Filter the frames in place just as the stage does: the first frame only seeds the reference.
+static void denoise(Sequence &seq, double strength, double uv_strength, unsigned int threads)
+{
+	TemporalFilterKernel y_kernel = TemporalFilterKernel::Create(strength, 4, 16);
+	TemporalFilterKernel uv_kernel = TemporalFilterKernel::Create(uv_strength, 3, 12);
+	RowBandPool pool(threads);
+
+	unsigned int width = seq.width, height = seq.height;
+	std::vector<uint8_t> reference = seq.frames[0];
+	for (unsigned int i = 1; i < seq.frames.size(); i++)
+	{
+		uint8_t *image = seq.frames[i].data(), *ref = reference.data();
+		ApplyKernel(y_kernel, image, ref, width, height, width, pool);
+		size_t y_size = width * height;
+		ApplyKernel(uv_kernel, image + y_size, ref + y_size, width / 2, 2 * (height / 2), width / 2, pool);
+	}
+}
+
+static size_t encode(Sequence const &seq, int crf, std::string const &preset)
+{
+	AVCodec const *codec = avcodec_find_encoder_by_name("libx264");
+	if (!codec)
+		throw std::runtime_error("libx264 encoder not available");
+
+	AVCodecContext *ctx = avcodec_alloc_context3(codec);
+	AVFrame *frame = av_frame_alloc();
+	AVPacket *pkt = av_packet_alloc();
+	if (!ctx || !frame || !pkt)
+		throw std::runtime_error("unable to allocate libav objects");
+
+	ctx->width = seq.width;
+	ctx->height = seq.height;
+	ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+	ctx->time_base = { 1, 30 };
+	ctx->framerate = { 30, 1 };
+	ctx->gop_size = 30;
+	ctx->thread_count = 1;
+	av_opt_set(ctx->priv_data, "preset", preset.c_str(), 0);
+	av_opt_set_int(ctx->priv_data, "crf", crf, 0);
+	if (avcodec_open2(ctx, codec, nullptr) < 0)
+		throw std::runtime_error("unable to open libx264");
+
+	size_t bytes = 0;
+	auto drain = [&]() {
+		while (avcodec_receive_packet(ctx, pkt) == 0)
+		{
+			bytes += pkt->size;
+			av_packet_unref(pkt);
+		}
+	};
+
+	frame->format = ctx->pix_fmt;
+	frame->width = ctx->width;
+	frame->height = ctx->height;
+	for (unsigned int i = 0; i < seq.frames.size(); i++)
+	{
+		uint8_t *data = const_cast<uint8_t *>(seq.frames[i].data());
+		size_t y_size = seq.width * seq.height, uv_size = (seq.width / 2) * (seq.height / 2);
+		frame->data[0] = data;
+		frame->data[1] = data + y_size;
+		frame->data[2] = data + y_size + uv_size;
+		frame->linesize[0] = seq.width;
+		frame->linesize[1] = frame->linesize[2] = seq.width / 2;
+		frame->pts = i;
+		if (avcodec_send_frame(ctx, frame) < 0)
+			throw std::runtime_error("unable to encode frame");
+		drain();
+	}
+	avcodec_send_frame(ctx, nullptr);
+	drain();
+
+	av_packet_free(&pkt);
+	av_frame_free(&frame);
+	avcodec_free_context(&ctx);
+	return bytes;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		unsigned int width, height, frames, threads;
+		double noise, strength, uv_strength;
+		int crf;
+		std::string preset;
+
+		po::options_description options("denoise-bitrate options");
+		// clang-format off
+		options.add_options()
+			("help,h", "Print this help message")
+			("width", po::value<unsigned int>(&width)->default_value(640), "Width of the synthetic frames")
+			("height", po::value<unsigned int>(&height)->default_value(480), "Height of the synthetic frames")
+			("frames", po::value<unsigned int>(&frames)->default_value(60), "Number of frames to generate")
+			("noise", po::value<double>(&noise)->default_value(6), "Standard deviation of the added noise")
+			("strength", po::value<double>(&strength)->default_value(0.75), "Denoise strength for Y")
+			("uv-strength", po::value<double>(&uv_strength)->default_value(0.85), "Denoise strength for U and V")
+			("threads", po::value<unsigned int>(&threads)->default_value(2), "Threads for the denoise filter")
+			("crf", po::value<int>(&crf)->default_value(23), "libx264 constant rate factor")
+			("preset", po::value<std::string>(&preset)->default_value("superfast"), "libx264 preset")
+			;
+		// clang-format on
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, options), vm);
+		po::notify(vm);
+		if (vm.count("help"))
+		{
+			std::cout << options;
+			return 0;
+		}
+		if (width < 64 || height < 64 || (width & 1) || (height & 1) || frames < 2)
+			throw std::runtime_error("need even dimensions of at least 64x64 and 2 or more frames");
+		if (strength < 0 || strength > 1 || uv_strength < 0 || uv_strength > 1)
+			throw std::runtime_error("strengths must be between 0 and 1");
+
+		Sequence seq = make_sequence(width, height, frames, noise);
+		size_t original = encode(seq, crf, preset);
+		denoise(seq, strength, uv_strength, threads);
+		size_t denoised = encode(seq, crf, preset);
+
+		double reduction = 100.0 * (1.0 - static_cast<double>(denoised) / original);
+		std::cout << frames << " frames " << width << "x" << height << " noise " << noise << " crf " << crf
+				  << ": " << original << " bytes original, " << denoised << " bytes denoised, " << std::fixed
+				  << std::setprecision(1) << "reduction " << reduction << "%" << std::endl;
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
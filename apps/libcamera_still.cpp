@@ -110,7 +110,8 @@ static void save_images(LibcameraStillApp &app, CompletedRequestPtr &payload)
 		options->framestart %= options->wrap;
 }
 
-static void save_metadata(StillOptions const *options, libcamera::ControlList &metadata)
+static void save_metadata(StillOptions const *options, libcamera::ControlList &metadata,
+						  CompletedRequest::ExtraMetadata const &extra_metadata)
 {
 	std::streambuf *buf = std::cout.rdbuf();
 	std::ofstream of;
@@ -122,7 +123,7 @@ static void save_metadata(StillOptions const *options, libcamera::ControlList &m
 		buf = of.rdbuf();
 	}
 
-	write_metadata(buf, options->metadata_format, metadata, true);
+	write_metadata(buf, options->metadata_format, metadata, true, extra_metadata);
 }
 
 // Some keypress/signal handling.
@@ -304,7 +305,7 @@ static void event_loop(LibcameraStillApp &app)
 			LOG(1, "Still capture image received");
 			save_images(app, completed_request);
 			if (!options->metadata.empty())
-				save_metadata(options, completed_request->metadata);
+				save_metadata(options, completed_request->metadata, completed_request->extra_metadata);
 			timelapse_frames = 0;
 			if (!options->immediate && (options->timelapse || options->signal || options->keypress))
 			{
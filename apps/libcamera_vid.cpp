@@ -6,10 +6,15 @@
  */
 
 #include <chrono>
+#include <deque>
 #include <poll.h>
 #include <signal.h>
+#include <sstream>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "core/libcamera_encoder.hpp"
 #include "output/output.hpp"
@@ -52,6 +57,149 @@ static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
 	return key;
 }
 
+// Commands to change the encoder's settings arrive on a datagram socket, one per message, so
+// that an external controller (for example, one adapting the bitrate to the network) can
+// drive the encoder without restarting us. We check for them every frame.
+
+class EncoderControl
+{
+public:
+	EncoderControl(std::string const &path) : path_(path)
+	{
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("control socket name too long");
+		path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+		fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd_ < 0)
+			throw std::runtime_error("unable to open control socket");
+		unlink(path.c_str());
+		if (bind(fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			close(fd_);
+			throw std::runtime_error("unable to bind control socket " + path);
+		}
+		LOG(2, "Listening for encoder commands on " << path);
+	}
+
+	~EncoderControl()
+	{
+		close(fd_);
+		unlink(path_.c_str());
+	}
+
+	void Poll(LibcameraEncoder &app)
+	{
+		char buf[256];
+		ssize_t len;
+		while ((len = recv(fd_, buf, sizeof(buf) - 1, 0)) > 0)
+		{
+			buf[len] = 0;
+			std::istringstream command(buf);
+			std::string name, value;
+			command >> name >> value;
+			bool ok = false;
+			try
+			{
+				if (name == "keyframe")
+				{
+					app.RequestKeyframe();
+					ok = true;
+				}
+				else if (name == "bitrate")
+				{
+					Bitrate bitrate;
+					bitrate.set(value);
+					ok = app.SetEncoderBitrate(bitrate.bps());
+				}
+				else if (name == "intra")
+					ok = app.SetEncoderIntraPeriod(std::stoul(value));
+			}
+			catch (std::exception const &e)
+			{
+				// A bad value, reported below.
+			}
+			if (!ok)
+				LOG_ERROR("Encoder command failed: " << buf);
+		}
+	}
+
+private:
+	std::string path_;
+	int fd_;
+};
+
+// When gating is enabled, frames are only encoded while a post-processing stage says
+// something is happening (for example, "motion_detect.result" is true), and for a while
+// afterwards. While the gate is closed the encoder does nothing at all, but we hold on to
+// the most recent few camera frames so that the start of each event isn't lost.
+
+class RecordingGate
+{
+public:
+	RecordingGate(VideoOptions const *options)
+		: key_(options->gate), preroll_(options->gate_preroll),
+		  postroll_(std::chrono::milliseconds(options->gate_postroll)), open_(false), events_(0)
+	{
+	}
+
+	~RecordingGate()
+	{
+		if (events_)
+			LOG(1, "Gate opened " << events_ << " times");
+	}
+
+	void Process(LibcameraEncoder &app, CompletedRequestPtr &completed_request)
+	{
+		bool active = false;
+		completed_request->post_process_metadata.Get(key_, active);
+		auto now = std::chrono::steady_clock::now();
+		if (active)
+			last_active_ = now;
+
+		if (active && !open_)
+		{
+			LOG(1, "Gate opened at frame " << completed_request->sequence << " with " << held_.size()
+										   << " frames of pre-roll");
+			open_ = true;
+			events_++;
+			// The encoder has been idle, so start the event cleanly.
+			app.RequestKeyframe();
+			while (!held_.empty())
+			{
+				app.EncodeBuffer(held_.front(), app.VideoStream());
+				held_.pop_front();
+			}
+		}
+		else if (!active && open_ && now - last_active_ > postroll_)
+		{
+			LOG(1, "Gate closed at frame " << completed_request->sequence);
+			open_ = false;
+		}
+
+		if (open_)
+			app.EncodeBuffer(completed_request, app.VideoStream());
+		else if (preroll_)
+		{
+			// Dropping the oldest frame gives its buffers back to the camera.
+			held_.push_back(completed_request);
+			if (held_.size() > preroll_)
+				held_.pop_front();
+		}
+	}
+
+private:
+	std::string key_;
+	unsigned int preroll_;
+	std::chrono::steady_clock::duration postroll_;
+	bool open_;
+	unsigned int events_;
+	std::chrono::steady_clock::time_point last_active_;
+	std::deque<CompletedRequestPtr> held_;
+};
+
 static int get_colourspace_flags(std::string const &codec)
 {
 	if (codec == "mjpeg" || codec == "yuv420")
@@ -65,9 +213,17 @@ static int get_colourspace_flags(std::string const &codec)
 static void event_loop(LibcameraEncoder &app)
 {
 	VideoOptions const *options = app.GetOptions();
-	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	// The main encoder's output comes first, followed by one for each additional rendition.
+	std::vector<std::unique_ptr<Output>> outputs;
+	outputs.emplace_back(Output::Create(options));
+	for (auto const &rendition_options : options->renditions)
+		outputs.emplace_back(Output::Create(rendition_options.get()));
+	for (unsigned int i = 0; i < outputs.size(); i++)
+	{
+		app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, outputs[i].get(), _1, _2, _3, _4), i);
+		app.SetEncodeOutputBufferCallback(std::bind(&Output::BufferReady, outputs[i].get(), _1), i);
+	}
+	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, outputs[0].get(), _1, _2, _3));
 
 	app.OpenCamera();
 	app.ConfigureVideo(get_colourspace_flags(options->codec));
@@ -80,6 +236,12 @@ static void event_loop(LibcameraEncoder &app)
 	signal(SIGUSR2, default_signal_handler);
 	signal(SIGINT, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
+	std::unique_ptr<EncoderControl> control;
+	if (!options->control_socket.empty())
+		control = std::make_unique<EncoderControl>(options->control_socket);
+	std::unique_ptr<RecordingGate> gate;
+	if (!options->gate.empty())
+		gate = std::make_unique<RecordingGate>(options);
 
 	for (unsigned int count = 0; ; count++)
 	{
@@ -97,7 +259,10 @@ static void event_loop(LibcameraEncoder &app)
 			throw std::runtime_error("unrecognised message!");
 		int key = get_key_or_signal(options, p);
 		if (key == '\n')
-			output->Signal();
+		{
+			for (auto &output : outputs)
+				output->Signal();
+		}
 
 		LOG(2, "Viewfinder frame " << count);
 		auto now = std::chrono::high_resolution_clock::now();
@@ -109,13 +274,20 @@ static void event_loop(LibcameraEncoder &app)
 			if (timeout)
 				LOG(1, "Halting: reached timeout of " << options->timeout.get<std::chrono::milliseconds>()
 													  << " milliseconds.");
+			gate.reset(); // release any held frames before the camera stops
 			app.StopCamera(); // stop complains if encoder very slow to close
 			app.StopEncoder();
 			return;
 		}
 
+		if (control)
+			control->Poll(app);
+
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		app.EncodeBuffer(completed_request, app.VideoStream());
+		if (gate)
+			gate->Process(app, completed_request);
+		else
+			app.EncodeBuffer(completed_request, app.VideoStream());
 		app.ShowPreview(completed_request, app.VideoStream());
 	}
 }
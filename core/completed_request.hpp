@@ -7,18 +7,23 @@
 
 #pragma once
 
+#include <map>
 #include <memory>
+#include <string>
 
 #include <libcamera/controls.h>
 #include <libcamera/request.h>
 
 #include "core/metadata.hpp"
 
+class ImageCache;
+
 struct CompletedRequest
 {
 	using BufferMap = libcamera::Request::BufferMap;
 	using ControlList = libcamera::ControlList;
 	using Request = libcamera::Request;
+	using ExtraMetadata = std::map<std::string, std::string>;
 
 	CompletedRequest(unsigned int seq, Request *r)
 		: sequence(seq), buffers(r->buffers()), metadata(r->metadata()), request(r)
@@ -31,6 +36,12 @@ struct CompletedRequest
 	Request *request;
 	float framerate;
 	Metadata post_process_metadata;
+	// Images derived from the buffers, shared between post-processing stages. Stages for
+	// a request all run in the same thread, so this needs no lock.
+	std::map<libcamera::Stream const *, std::shared_ptr<ImageCache>> image_cache;
+	// Results that post-processing stages want written to the --metadata output along with
+	// the camera metadata, as names and values (already formatted as JSON values).
+	ExtraMetadata extra_metadata;
 };
 
 using CompletedRequestPtr = std::shared_ptr<CompletedRequest>;
@@ -14,7 +14,8 @@
 #include "encoder/encoder.hpp"
 
 typedef std::function<void(void *, size_t, int64_t, bool)> EncodeOutputReadyCallback;
-typedef std::function<void(libcamera::ControlList &)> MetadataReadyCallback;
+typedef std::function<void(int64_t, libcamera::ControlList &, CompletedRequest::ExtraMetadata &)>
+	MetadataReadyCallback;
 
 class LibcameraEncoder : public LibcameraApp
 {
@@ -22,37 +23,100 @@ public:
 	using Stream = libcamera::Stream;
 	using FrameBuffer = libcamera::FrameBuffer;
 
-	LibcameraEncoder() : LibcameraApp(std::make_unique<VideoOptions>()) {}
+	LibcameraEncoder() : LibcameraApp(std::make_unique<VideoOptions>()), renditions_(1) {}
 
 	void StartEncoder()
 	{
 		createEncoder();
-		encoder_->SetInputDoneCallback(std::bind(&LibcameraEncoder::encodeBufferDone, this, std::placeholders::_1));
-		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		// Any additional renditions (listed in the options) follow the main encoder.
+		renditions_.resize(1 + GetOptions()->renditions.size());
+		for (unsigned int i = 1; i < renditions_.size(); i++)
+			createRendition(i);
+		for (unsigned int i = 0; i < renditions_.size(); i++)
+		{
+			Encoder *encoder = getEncoder(i);
+			encoder->SetInputDoneCallback(
+				std::bind(&LibcameraEncoder::encodeBufferDone, this, i, std::placeholders::_1));
+			encoder->SetOutputReadyCallback(renditions_[i].output_ready_callback);
+			encoder->SetOutputBufferCallback(renditions_[i].output_buffer_callback);
+		}
+	}
+	// This is callback when the encoder gives you the encoded output data. Rendition 0 is the
+	// main encoder, and the others are those in the options' renditions list, in order.
+	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback, unsigned int rendition = 0)
+	{
+		getRendition(rendition).output_ready_callback = callback;
 	}
-	// This is callback when the encoder gives you the encoded output data.
-	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
+	// Optionally, receive handles to encoded buffers which can be kept after the callback
+	// returns (only where the encoder supports this).
+	void SetEncodeOutputBufferCallback(OutputBufferCallback callback, unsigned int rendition = 0)
+	{
+		getRendition(rendition).output_buffer_callback = callback;
+	}
+	// The main encoder's metadata is passed on, with the frame's timestamp, before the frame
+	// is given to the encoder, so it always arrives before the encoded output does.
 	void SetMetadataReadyCallback(MetadataReadyCallback callback) { metadata_ready_callback_ = callback; }
+	// Encode the request's buffer from the given stream with the main encoder, and from their
+	// own streams with any other renditions.
 	void EncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
 		assert(encoder_);
-		StreamInfo info = GetStreamInfo(stream);
-		FrameBuffer *buffer = completed_request->buffers[stream];
-		BufferReadSync r(this, buffer);
-		libcamera::Span span = r.Get()[0];
-		void *mem = span.data();
-		if (!buffer || !mem)
-			throw std::runtime_error("no buffer to encode");
 		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
-		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+		// A post-processing stage (such as scene_detect) may ask for this frame to be a keyframe.
+		bool force_keyframe = false;
+		completed_request->post_process_metadata.Get("scene_detect.keyframe", force_keyframe);
+		// And the encode_roi stage may give regions to encode at a different quality.
+		RegionsOfInterest regions;
+		completed_request->post_process_metadata.Get("encode_roi.regions", regions);
+		for (unsigned int i = 0; i < renditions_.size(); i++)
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			Stream *rendition_stream = i ? renditions_[i].stream : stream;
+			StreamInfo info = GetStreamInfo(rendition_stream);
+			FrameBuffer *buffer = completed_request->buffers[rendition_stream];
+			if (!buffer)
+				throw std::runtime_error("no buffer to encode");
+			BufferReadSync r(this, buffer);
+			libcamera::Span span = r.Get()[0];
+			void *mem = span.data();
+			if (!mem)
+				throw std::runtime_error("no buffer to encode");
+			int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+			{
+				std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+				Rendition &rendition = renditions_[i];
+				InFlight &item = rendition.encode_buffer_queue[rendition.encode_index++];
+				item.mem = mem;
+				item.completed_request = completed_request; // creates a new reference
+			}
+			if (i == 0 && metadata_ready_callback_ && !GetOptions()->metadata.empty())
+				metadata_ready_callback_(timestamp_ns / 1000, completed_request->metadata,
+										 completed_request->extra_metadata);
+			Encoder *encoder = getEncoder(i);
+			encoder->SetRegionsOfInterest(regions);
+			encoder->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000,
+								  force_keyframe);
 		}
-		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(options_.get()); }
-	void StopEncoder() { encoder_.reset(); }
+	void StopEncoder()
+	{
+		for (unsigned int i = 1; i < renditions_.size(); i++)
+			renditions_[i].encoder.reset();
+		encoder_.reset();
+	}
+	// Control the encoder while it's running (see Encoder). These return false if the
+	// encoder can't do what was asked. Keyframes are requested from every rendition, but the
+	// other settings apply only to the main encoder.
+	void RequestKeyframe()
+	{
+		for (unsigned int i = 0; i < renditions_.size(); i++)
+		{
+			if (Encoder *encoder = getEncoder(i))
+				encoder->RequestKeyframe();
+		}
+	}
+	bool SetEncoderBitrate(unsigned int bitrate_bps) { return encoder_ && encoder_->SetBitrate(bitrate_bps); }
+	bool SetEncoderIntraPeriod(unsigned int frames) { return encoder_ && encoder_->SetIntraPeriod(frames); }
 
 protected:
 	virtual void createEncoder()
@@ -66,26 +130,76 @@ protected:
 	std::unique_ptr<Encoder> encoder_;
 
 private:
-	void encodeBufferDone(void *mem)
+	// A request whose buffer an encoder is using. Encoders may finish with their input
+	// buffers in any order.
+	struct InFlight
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
-		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
-				throw std::runtime_error("no buffer available to return");
-			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
-			if (metadata_ready_callback_ && !GetOptions()->metadata.empty())
-				metadata_ready_callback_(completed_request->metadata);
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
-		}
+		void *mem;
+		CompletedRequestPtr completed_request;
+		bool done = false;
+	};
+
+	// Each rendition is an encoder with its own settings and output. Every one of them holds
+	// its own references to the requests it has yet to finish with, so a request goes back to
+	// the camera only once all the renditions are done with it.
+	struct Rendition
+	{
+		// Not used for rendition 0, which is encoder_ and encodes the stream passed to
+		// EncodeBuffer.
+		Stream *stream = nullptr;
+		std::unique_ptr<Encoder> encoder;
+		// Requests in the order they were given to the encoder.
+		std::map<uint64_t, InFlight> encode_buffer_queue;
+		uint64_t encode_index = 0;
+		EncodeOutputReadyCallback output_ready_callback;
+		OutputBufferCallback output_buffer_callback;
+	};
+
+	Rendition &getRendition(unsigned int rendition)
+	{
+		if (rendition >= renditions_.size())
+			renditions_.resize(rendition + 1);
+		return renditions_[rendition];
+	}
+
+	Encoder *getEncoder(unsigned int rendition)
+	{
+		return rendition ? renditions_[rendition].encoder.get() : encoder_.get();
+	}
+
+	void createRendition(unsigned int rendition)
+	{
+		VideoOptions *options = GetOptions()->renditions[rendition - 1].get();
+		StreamInfo info;
+		Stream *stream = options->rendition_stream == "lores" ? LoresStream(&info) : VideoStream(&info);
+		if (!stream)
+			throw std::runtime_error("rendition " + std::to_string(rendition) +
+									 " needs a lores stream (set --lores-width and --lores-height)");
+		renditions_[rendition].stream = stream;
+		renditions_[rendition].encoder = std::unique_ptr<Encoder>(Encoder::Create(options, info));
+	}
+
+	void encodeBufferDone(unsigned int rendition, void *mem)
+	{
+		std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+		auto &encode_buffer_queue = renditions_[rendition].encode_buffer_queue;
+		// Encoders that don't say which buffer they've finished with (a null mem) must be
+		// finishing them in order.
+		auto it = std::find_if(encode_buffer_queue.begin(), encode_buffer_queue.end(), [mem](auto const &item) {
+			return !item.second.done && (!mem || item.second.mem == mem);
+		});
+		if (it == encode_buffer_queue.end())
+			throw std::runtime_error("no buffer available to return");
+
+		it->second.done = true;
+		it->second.completed_request.reset(); // drop shared_ptr reference
+
+		// Entries are removed in order, so that the search above finds the oldest first.
+		while (!encode_buffer_queue.empty() && encode_buffer_queue.begin()->second.done)
+			encode_buffer_queue.erase(encode_buffer_queue.begin());
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
+	std::vector<Rendition> renditions_;
 	std::mutex encode_buffer_queue_mutex_;
-	EncodeOutputReadyCallback encode_output_ready_callback_;
 	MetadataReadyCallback metadata_ready_callback_;
 };
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * region_of_interest.hpp - image regions that an encoder should treat differently
+ */
+
+#pragma once
+
+#include <vector>
+
+// A region of the image, given as fractions of the image size so that it applies to
+// streams of any resolution, and how its quality should change. A negative qoffset (down
+// to -1) asks for better quality than the rest of the image, and a positive one for worse.
+struct RegionOfInterest
+{
+	float x, y, width, height;
+	float qoffset;
+};
+
+typedef std::vector<RegionOfInterest> RegionsOfInterest;
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * spsc_queue.hpp - lock-free queue between one producer and one consumer thread
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// A fixed size ring of items, which one thread may push and one other thread may pop
+// without either of them ever taking a lock. Neither side blocks: a push fails if the
+// queue is full and a pop if it is empty, and the caller decides what to do about it.
+
+template <typename T>
+class SpscQueue
+{
+public:
+	SpscQueue(size_t capacity) : ring_(capacity + 1), head_(0), tail_(0) {}
+
+	// Producer only.
+	bool Push(T const &item)
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		size_t next = tail + 1 == ring_.size() ? 0 : tail + 1;
+		if (next == head_.load(std::memory_order_acquire))
+			return false;
+		ring_[tail] = item;
+		tail_.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Front returns the next item without removing it, or nullptr.
+	T *Front()
+	{
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+			return nullptr;
+		return &ring_[head];
+	}
+
+	bool Pop(T &item)
+	{
+		T *front = Front();
+		if (!front)
+			return false;
+		item = *front;
+		size_t head = head_.load(std::memory_order_relaxed);
+		head_.store(head + 1 == ring_.size() ? 0 : head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Either side may use this, though the answer may be stale by the time it returns.
+	size_t Size() const
+	{
+		size_t head = head_.load(std::memory_order_acquire), tail = tail_.load(std::memory_order_acquire);
+		return tail >= head ? tail - head : tail + ring_.size() - head;
+	}
+
+private:
+	std::vector<T> ring_;
+	// Keep the two ends apart so that the threads aren't fighting over a cache line.
+	alignas(64) std::atomic<size_t> head_;
+	alignas(64) std::atomic<size_t> tail_;
+};
@@ -32,6 +32,8 @@ struct StillOptions : public Options
 			 "Use system timestamps for output file names")
 			("restart", value<unsigned int>(&restart)->default_value(0),
 			 "Set JPEG restart interval")
+			("jpeg-slices", value<unsigned int>(&jpeg_slices)->default_value(1),
+			 "Number of slices to encode JPEG images in parallel, or 0 for one per CPU core")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
 			 "Perform capture when ENTER pressed")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
@@ -59,6 +61,7 @@ struct StillOptions : public Options
 	bool datetime;
 	bool timestamp;
 	unsigned int restart;
+	unsigned int jpeg_slices;
 	bool keypress;
 	bool signal;
 	std::string thumb;
@@ -102,6 +105,7 @@ struct StillOptions : public Options
 		std::cerr << "    quality: " << quality << std::endl;
 		std::cerr << "    raw: " << raw << std::endl;
 		std::cerr << "    restart: " << restart << std::endl;
+		std::cerr << "    jpeg slices: " << jpeg_slices << std::endl;
 		std::cerr << "    timelapse: " << timelapse.get() << "ms" << std::endl;
 		std::cerr << "    framestart: " << framestart << std::endl;
 		std::cerr << "    datetime: " << datetime << std::endl;
@@ -9,7 +9,10 @@
 
 #include <cstdio>
 
+#include <memory>
+#include <sstream>
 #include <string>
+#include <vector>
 
 #include "options.hpp"
 
@@ -106,8 +109,20 @@ struct VideoOptions : public Options
 			 "Save a timestamp file with this name")
 			("quality,q", value<int>(&quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
+			("mjpeg-threads", value<unsigned int>(&mjpeg_threads)->default_value(4),
+			 "Number of threads to use for MJPEG encoding, or 0 for one per CPU core (mjpeg only)")
+			("mjpeg-slices", value<unsigned int>(&mjpeg_slices)->default_value(1),
+			 "Number of slices to encode each MJPEG frame in parallel, or 0 for one per CPU core (mjpeg only)")
 			("listen,l", value<bool>(&listen)->default_value(false)->implicit_value(true),
-			 "Listen for an incoming client network connection before sending data to the client")
+			 "Listen for incoming client network connections, and send the stream to every client")
+			("client-queue", value<unsigned int>(&client_queue)->default_value(8),
+			 "Most frames that can wait to be sent to each client, in listen mode or for http:// outputs, before it "
+			 "has to skip ahead to the next keyframe")
+			("mtu", value<unsigned int>(&mtu)->default_value(1500),
+			 "Network MTU, which limits the size of the packets sent for rtp:// outputs")
+			("pacing", value<std::string>(&pacing_)->default_value("0"),
+			 "Spread the packets for rtp:// outputs out so as not to exceed this bitrate, or 0 to send them "
+			 "straight away. If no units are provided, default to bits/second.")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
 			 "Pause or resume video recording when ENTER pressed")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
@@ -122,6 +137,43 @@ struct VideoOptions : public Options
 			 "Write output to a circular buffer of the given size (in MB) which is saved on exit")
 			("frames", value<unsigned int>(&frames)->default_value(0),
 			 "Run for the exact number of frames specified. This will override any timeout set.")
+			("output-buffer", value<unsigned int>(&output_buffer)->default_value(8),
+			 "Size in MB of the buffer for data waiting to be written to the output file by a separate thread, "
+			 "or 0 to write it straight away")
+			("output-backend", value<std::string>(&output_backend)->default_value("stdio"),
+			 "How the buffered output is written to files, either stdio or io_uring (where available)")
+			("output-direct", value<bool>(&output_direct)->default_value(false)->implicit_value(true),
+			 "Bypass the page cache when writing output files (io_uring only)")
+			("output-preallocate", value<unsigned int>(&output_preallocate)->default_value(0),
+			 "Reserve this many MB of space for each output file when it's opened (io_uring only)")
+			("h264-input-buffers", value<unsigned int>(&h264_input_buffers)->default_value(6),
+			 "Number of camera frames that can be queued in the H.264 encoder (h264 only)")
+			("h264-output-buffers", value<unsigned int>(&h264_output_buffers)->default_value(12),
+			 "Number of buffers for encoded H.264 frames waiting to be output (h264 only)")
+			("h264-copy-threshold", value<unsigned int>(&h264_copy_threshold)->default_value(0),
+			 "Copy encoded frames out of the H.264 encoder's buffers when fewer than this many are left for it, "
+			 "or 0 never to copy them (h264 only)")
+			("backpressure", value<std::string>(&backpressure)->default_value("wait"),
+			 "What to do with a new frame when the encoder is full: \"wait\" for up to backpressure-timeout "
+			 "and then drop it, or \"drop\" it at once (h264 only)")
+			("backpressure-timeout", value<unsigned int>(&backpressure_timeout)->default_value(1000),
+			 "Longest time in milliseconds to wait for the encoder when it's full (h264 only)")
+			("control-socket", value<std::string>(&control_socket),
+			 "Create a Unix datagram socket with this name on which to receive encoder commands: "
+			 "\"bitrate <value>\", \"keyframe\" or \"intra <frames>\"")
+			("gate", value<std::string>(&gate),
+			 "Only encode frames while this boolean post-processing result (such as \"motion_detect.result\") "
+			 "is true, and for gate-postroll afterwards")
+			("gate-preroll", value<unsigned int>(&gate_preroll)->default_value(5),
+			 "Number of camera frames held back while the gate is closed, so that they can be encoded when it "
+			 "opens (gate only)")
+			("gate-postroll", value<unsigned int>(&gate_postroll)->default_value(2000),
+			 "Time in milliseconds to keep encoding after the gate result becomes false (gate only)")
+			("rendition", value<std::vector<std::string>>(&rendition)->composing(),
+			 "Encode an additional rendition of the video, given as comma-separated key=value settings that "
+			 "override the main ones: stream (main or lores), codec, bitrate, quality, intra, profile, level, "
+			 "inline, listen and output. May be given more than once. For example "
+			 "\"stream=lores,bitrate=1M,output=udp://10.0.0.2:5000\"")
 #if LIBAV_PRESENT
 			("libav-video-codec", value<std::string>(&libav_video_codec)->default_value("h264_v4l2m2m"),
 			 "Sets the libav video codec to use. "
@@ -130,6 +182,9 @@ struct VideoOptions : public Options
 			 "Sets the libav encoder output format to use. "
 			 "Leave blank to try and deduce this from the filename.\n"
 			 "To list available formats, run  the \"ffmpeg -formats\" command.")
+			("libav-latency", value<std::string>(&libav_latency)->default_value("normal"),
+			 "Use \"low\" to tune libx264 for the lowest latency (slice threads, no lookahead or B frames, and "
+			 "intra refresh instead of IDR frames) at some cost in throughput, otherwise \"normal\"")
 			("libav-audio", value<bool>(&libav_audio)->default_value(false)->implicit_value(true),
 			 "Records an audio stream together with the video.")
 			("audio-codec", value<std::string>(&audio_codec)->default_value("aac"),
@@ -165,6 +220,7 @@ struct VideoOptions : public Options
 	std::string codec;
 	std::string libav_video_codec;
 	std::string libav_format;
+	std::string libav_latency;
 	bool libav_audio;
 	std::string audio_codec;
 	std::string audio_device;
@@ -175,7 +231,12 @@ struct VideoOptions : public Options
 	TimeVal<std::chrono::microseconds> av_sync;
 	std::string save_pts;
 	int quality;
+	unsigned int mjpeg_threads;
+	unsigned int mjpeg_slices;
 	bool listen;
+	unsigned int client_queue;
+	unsigned int mtu;
+	Bitrate pacing;
 	bool keypress;
 	bool signal;
 	std::string initial;
@@ -184,6 +245,24 @@ struct VideoOptions : public Options
 	uint32_t segment;
 	size_t circular;
 	uint32_t frames;
+	unsigned int output_buffer;
+	std::string output_backend;
+	bool output_direct;
+	unsigned int output_preallocate;
+	unsigned int h264_input_buffers;
+	unsigned int h264_output_buffers;
+	unsigned int h264_copy_threshold;
+	std::string backpressure;
+	unsigned int backpressure_timeout;
+	std::string control_socket;
+	std::string gate;
+	unsigned int gate_preroll;
+	unsigned int gate_postroll;
+	std::vector<std::string> rendition;
+	// The stream this encoder takes its frames from, "main" or "lores" (only renditions can
+	// use the lores stream).
+	std::string rendition_stream;
+	std::vector<std::shared_ptr<VideoOptions>> renditions;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -191,24 +270,35 @@ struct VideoOptions : public Options
 			return false;
 
 		bitrate.set(bitrate_);
+		pacing.set(pacing_);
 #if LIBAV_PRESENT
 		av_sync.set(av_sync_);
 		audio_bitrate.set(audio_bitrate_);
+		if (libav_latency != "normal" && libav_latency != "low")
+			throw std::runtime_error("libav-latency must be normal or low");
 #endif /* LIBAV_PRESENT */
 		if (width == 0)
 			width = 640;
 		if (height == 0)
 			height = 480;
-		if (strcasecmp(codec.c_str(), "h264") == 0)
-			codec = "h264";
-		else if (strcasecmp(codec.c_str(), "libav") == 0)
-			codec = "libav";
-		else if (strcasecmp(codec.c_str(), "yuv420") == 0)
-			codec = "yuv420";
-		else if (strcasecmp(codec.c_str(), "mjpeg") == 0)
-			codec = "mjpeg";
-		else
-			throw std::runtime_error("unrecognised codec " + codec);
+		codec = canonicalCodec(codec);
+		if (backpressure != "wait" && backpressure != "drop")
+			throw std::runtime_error("backpressure must be wait or drop");
+		// Network clients hold on to frames until they've been sent, so make sure the encoder
+		// doesn't run out of buffers waiting for them.
+		bool serving = (listen && output.rfind("tcp://", 0) == 0) || output.rfind("http://", 0) == 0;
+		if (serving && !h264_copy_threshold)
+			h264_copy_threshold = std::max(h264_output_buffers / 2, 1u);
+		if (!client_queue)
+			throw std::runtime_error("client-queue must be at least 1");
+		if (mtu < 256)
+			throw std::runtime_error("mtu must be at least 256");
+		if (output_backend != "stdio" && output_backend != "io_uring")
+			throw std::runtime_error("output-backend must be stdio or io_uring");
+		if (output_backend == "stdio" && (output_direct || output_preallocate))
+			LOG_ERROR("WARNING: output-direct and output-preallocate need the io_uring output backend");
+		if (!h264_input_buffers || !h264_output_buffers)
+			throw std::runtime_error("must have at least one H.264 input and output buffer");
 		if (strcasecmp(initial.c_str(), "pause") == 0)
 			pause = true;
 		else if (strcasecmp(initial.c_str(), "record") == 0)
@@ -228,6 +318,19 @@ struct VideoOptions : public Options
 			level = "4.2";
 		}
 
+		// Frames held for the pre-roll aren't available to the camera, so make sure it has
+		// enough to keep running.
+		if (!gate.empty() && gate_preroll && buffer_count < gate_preroll + 4)
+		{
+			LOG(2, "Using " << gate_preroll + 4 << " camera buffers for the gate pre-roll");
+			buffer_count = gate_preroll + 4;
+		}
+
+		rendition_stream = "main";
+		renditions.clear();
+		for (auto const &spec : rendition)
+			renditions.push_back(makeRendition(spec));
+
 		return true;
 	}
 	virtual void Print() const override
@@ -241,16 +344,104 @@ struct VideoOptions : public Options
 		std::cerr << "    save-pts: " << save_pts << std::endl;
 		std::cerr << "    codec: " << codec << std::endl;
 		std::cerr << "    quality (for MJPEG): " << quality << std::endl;
+		std::cerr << "    threads (for MJPEG): " << mjpeg_threads << std::endl;
+		std::cerr << "    slices (for MJPEG): " << mjpeg_slices << std::endl;
 		std::cerr << "    keypress: " << keypress << std::endl;
 		std::cerr << "    signal: " << signal << std::endl;
 		std::cerr << "    initial: " << initial << std::endl;
 		std::cerr << "    split: " << split << std::endl;
 		std::cerr << "    segment: " << segment << std::endl;
 		std::cerr << "    circular: " << circular << std::endl;
+		if (pacing)
+			std::cerr << "    pacing: " << pacing.kbps() << "kbps" << std::endl;
+		std::cerr << "    mtu: " << mtu << std::endl;
+		std::cerr << "    client queue: " << client_queue << std::endl;
+		std::cerr << "    output buffer: " << output_buffer << "MB" << std::endl;
+		std::cerr << "    output backend: " << output_backend << (output_direct ? " (direct)" : "") << std::endl;
+		std::cerr << "    output preallocate: " << output_preallocate << "MB" << std::endl;
+		std::cerr << "    h264 buffers: " << h264_input_buffers << " input, " << h264_output_buffers << " output"
+				  << std::endl;
+		std::cerr << "    h264 copy threshold: " << h264_copy_threshold << std::endl;
+		std::cerr << "    backpressure: " << backpressure << " (timeout " << backpressure_timeout << "ms)" << std::endl;
+		std::cerr << "    control socket: " << control_socket << std::endl;
+		if (!gate.empty())
+			std::cerr << "    gate: " << gate << " (pre-roll " << gate_preroll << " frames, post-roll " << gate_postroll
+					  << "ms)" << std::endl;
+		for (auto const &spec : rendition)
+			std::cerr << "    rendition: " << spec << std::endl;
 	}
 
 private:
+	static std::string canonicalCodec(std::string const &codec)
+	{
+		for (char const *name : { "h264", "libav", "yuv420", "mjpeg" })
+		{
+			if (strcasecmp(codec.c_str(), name) == 0)
+				return name;
+		}
+		throw std::runtime_error("unrecognised codec " + codec);
+	}
+
+	// A rendition starts as a copy of our own settings, less those that only make sense once
+	// per recording, and then applies its own.
+	std::shared_ptr<VideoOptions> makeRendition(std::string const &spec) const
+	{
+		auto options = std::make_shared<VideoOptions>(*this);
+		options->rendition.clear();
+		options->renditions.clear();
+		options->save_pts.clear();
+		options->metadata.clear();
+		options->control_socket.clear();
+		options->libav_audio = false;
+
+		std::stringstream settings(spec);
+		std::string setting;
+		while (std::getline(settings, setting, ','))
+		{
+			size_t equals = setting.find('=');
+			if (equals == std::string::npos)
+				throw std::runtime_error("rendition setting " + setting + " should be key=value");
+			std::string key = setting.substr(0, equals), value = setting.substr(equals + 1);
+			try
+			{
+				if (key == "stream")
+					options->rendition_stream = value;
+				else if (key == "codec")
+					options->codec = canonicalCodec(value);
+				else if (key == "bitrate")
+					options->bitrate.set(value);
+				else if (key == "quality")
+					options->quality = std::stoi(value);
+				else if (key == "intra")
+					options->intra = std::stoul(value);
+				else if (key == "profile")
+					options->profile = value;
+				else if (key == "level")
+					options->level = value;
+				else if (key == "inline")
+					options->inline_headers = value != "0" && value != "false";
+				else if (key == "listen")
+					options->listen = value != "0" && value != "false";
+				else if (key == "output")
+					options->output = value;
+				else
+					throw std::runtime_error("unknown rendition setting " + key);
+			}
+			catch (std::logic_error const &e)
+			{
+				throw std::runtime_error("invalid value for rendition setting " + key);
+			}
+		}
+		if (options->rendition_stream != "main" && options->rendition_stream != "lores")
+			throw std::runtime_error("rendition stream must be main or lores");
+		if (options->output.empty())
+			throw std::runtime_error("rendition " + spec + " has no output");
+
+		return options;
+	}
+
 	std::string bitrate_;
+	std::string pacing_;
 #if LIBAV_PRESENT
 	std::string av_sync_;
 	std::string audio_bitrate_;
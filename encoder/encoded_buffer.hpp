@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * encoded_buffer.hpp - handle to an encoded frame that may be shared by several consumers.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// An encoded frame. Consumers may keep the handle for as long as they need the data, and the
+// encoder gets the memory back (to re-use) only when the last reference has gone.
+struct EncodedBuffer
+{
+	void *mem;
+	size_t size;
+	int64_t timestamp_us;
+	bool keyframe;
+};
+
+typedef std::shared_ptr<EncodedBuffer> EncodedBufferPtr;
+typedef std::function<void(EncodedBufferPtr const &)> OutputBufferCallback;
+
+// An encoded buffer that holds its own copy of the data.
+struct CopiedBuffer : public EncodedBuffer
+{
+	std::vector<uint8_t> data;
+};
+
+// Make an encoded buffer with its own copy of the data, for consumers that want to keep a
+// frame that the encoder didn't lend out. The copy goes in the storage given, if any (which
+// is resized to fit), and release, if given, gets the storage back when the last reference
+// has gone, so that it can be pooled.
+inline EncodedBufferPtr copy_encoded_buffer(void const *mem, size_t size, int64_t timestamp_us, bool keyframe,
+											std::vector<uint8_t> storage = {},
+											std::function<void(std::vector<uint8_t> &&)> release = nullptr)
+{
+	CopiedBuffer *copied = new CopiedBuffer;
+	copied->data = std::move(storage);
+	copied->data.resize(size);
+	memcpy(copied->data.data(), mem, size);
+	*static_cast<EncodedBuffer *>(copied) = { copied->data.data(), size, timestamp_us, keyframe };
+	return EncodedBufferPtr(copied, [release](EncodedBuffer *buffer) {
+		CopiedBuffer *copied = static_cast<CopiedBuffer *>(buffer);
+		if (release)
+			release(std::move(copied->data));
+		delete copied;
+	});
+}
@@ -7,11 +7,15 @@
 
 #pragma once
 
+#include <atomic>
 #include <functional>
 
+#include "core/region_of_interest.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
+#include "encoder/encoded_buffer.hpp"
+
 typedef std::function<void(void *)> InputDoneCallback;
 typedef std::function<void(void *, size_t, int64_t, bool)> OutputReadyCallback;
 
@@ -23,18 +27,51 @@ public:
 	Encoder(VideoOptions const *options) : options_(options) {}
 	virtual ~Encoder() {}
 	// This is where the application sets the callback it gets whenever the encoder
-	// has finished with an input buffer, so the application can re-use it.
+	// has finished with an input buffer, so the application can re-use it. Encoders
+	// pass the buffer's address, and may finish with buffers in any order.
 	void SetInputDoneCallback(InputDoneCallback callback) { input_done_callback_ = callback; }
 	// This callback is how the application is told that an encoded buffer is
 	// available. The application may not hang on to the memory once it returns
 	// (but the callback is already running in its own thread).
 	void SetOutputReadyCallback(OutputReadyCallback callback) { output_ready_callback_ = callback; }
+	// Alternatively, encoders that can lend out their buffers will pass a handle to this
+	// callback instead. The application may then hold on to the buffer for as long as it
+	// likes, though the encoder may stall if too many are kept.
+	void SetOutputBufferCallback(OutputBufferCallback callback) { output_buffer_callback_ = callback; }
 	// Encode the given buffer. The buffer is specified both by an fd and size
-	// describing a DMABUF, and by a mmapped userland pointer.
-	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) = 0;
+	// describing a DMABUF, and by a mmapped userland pointer. If force_keyframe is
+	// set, the encoder should start a new GOP with this frame (where it can).
+	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+							  bool force_keyframe) = 0;
+	// These change the encoder's behaviour while it's running, and may be called from any
+	// thread. They return false if the encoder can't do it (or failed). A keyframe request
+	// applies to the next buffer passed to EncodeBuffer.
+	void RequestKeyframe() { keyframe_requested_ = true; }
+	virtual bool SetBitrate(unsigned int bitrate_bps) { return false; }
+	virtual bool SetIntraPeriod(unsigned int frames) { return false; }
+	// Regions of the image to encode at a different quality, for the next buffer passed to
+	// EncodeBuffer (and called from the same thread). Encoders that can't do this ignore it.
+	void SetRegionsOfInterest(RegionsOfInterest const &regions) { regions_of_interest_ = regions; }
 
 protected:
+	// Encoders that support keyframe requests should call this for every frame.
+	bool keyframeRequested(bool force_keyframe) { return keyframe_requested_.exchange(false) || force_keyframe; }
+
+	// Encoders that lend out their buffers call this for each one.
+	void outputBuffer(EncodedBufferPtr const &buffer)
+	{
+		if (output_buffer_callback_)
+			output_buffer_callback_(buffer);
+		else
+			output_ready_callback_(buffer->mem, buffer->size, buffer->timestamp_us, buffer->keyframe);
+	}
+
 	InputDoneCallback input_done_callback_;
 	OutputReadyCallback output_ready_callback_;
+	OutputBufferCallback output_buffer_callback_;
 	VideoOptions const *options_;
+	RegionsOfInterest regions_of_interest_;
+
+private:
+	std::atomic<bool> keyframe_requested_ = false;
 };
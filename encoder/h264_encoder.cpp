@@ -7,6 +7,7 @@
 
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
@@ -15,6 +16,8 @@
 #include <chrono>
 #include <iostream>
 
+#include <libcamera/base/unique_fd.h>
+
 #include "h264_encoder.hpp"
 
 static int xioctl(int fd, unsigned long ctl, void *arg)
@@ -39,16 +42,26 @@ static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
 }
 
 H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
-	: Encoder(options), abortPoll_(false), abortOutput_(false)
+	: Encoder(options), abortPoll_(false), abortOutput_(false), backpressure_wait_(options->backpressure == "wait"),
+	  dropped_frames_(0), roi_warned_(false)
 {
 	// First open the encoder device. Maybe we should double-check its "caps".
 
+	// If anything below throws, these close the file descriptors. Only at the end does the
+	// destructor become responsible for them.
 	const char device_name[] = "/dev/video11";
-	fd_ = open(device_name, O_RDWR, 0);
-	if (fd_ < 0)
+	libcamera::UniqueFD device_fd(open(device_name, O_RDWR, 0));
+	if (!device_fd.isValid())
 		throw std::runtime_error("failed to open V4L2 H264 encoder");
+	fd_ = device_fd.get();
 	LOG(2, "Opened H264Encoder on " << device_name << " as fd " << fd_);
 
+	// This is how we wake the poll thread when it's time to stop.
+	libcamera::UniqueFD abort_event_fd(eventfd(0, EFD_CLOEXEC));
+	if (!abort_event_fd.isValid())
+		throw std::runtime_error("failed to create eventfd");
+	abort_event_fd_ = abort_event_fd.get();
+
 	// Apply any options->
 
 	v4l2_control ctrl = {};
@@ -120,8 +133,9 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 
 	fmt = {};
 	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	fmt.fmt.pix_mp.width = options->width;
-	fmt.fmt.pix_mp.height = options->height;
+	// The size of the stream we're given, which for a rendition isn't the size in the options.
+	fmt.fmt.pix_mp.width = info.width;
+	fmt.fmt.pix_mp.height = info.height;
 	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
 	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
 	fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_DEFAULT;
@@ -148,12 +162,14 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 	// m-mapped.
 
 	v4l2_requestbuffers reqbufs = {};
-	reqbufs.count = NUM_OUTPUT_BUFFERS;
+	reqbufs.count = options->h264_input_buffers;
 	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 	reqbufs.memory = V4L2_MEMORY_DMABUF;
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		throw std::runtime_error("request for output buffers failed");
 	LOG(2, "Got " << reqbufs.count << " output buffers");
+	num_output_buffers_ = reqbufs.count;
+	input_mem_.resize(reqbufs.count);
 
 	// We have to maintain a list of the buffers we can use when our caller gives
 	// us another frame to encode.
@@ -161,13 +177,15 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		input_buffers_available_.push(i);
 
 	reqbufs = {};
-	reqbufs.count = NUM_CAPTURE_BUFFERS;
+	reqbufs.count = options->h264_output_buffers;
 	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	reqbufs.memory = V4L2_MEMORY_MMAP;
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		throw std::runtime_error("request for capture buffers failed");
 	LOG(2, "Got " << reqbufs.count << " capture buffers");
-	num_capture_buffers_ = reqbufs.count;
+	buffers_.resize(reqbufs.count);
+	capture_buffers_ = std::make_shared<CaptureBuffers>();
+	capture_buffers_->fd = fd_;
 
 	for (unsigned int i = 0; i < reqbufs.count; i++)
 	{
@@ -203,15 +221,37 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 
 	output_thread_ = std::thread(&H264Encoder::outputThread, this);
 	poll_thread_ = std::thread(&H264Encoder::pollThread, this);
+	fd_ = device_fd.release();
+	abort_event_fd_ = abort_event_fd.release();
 }
 
 H264Encoder::~H264Encoder()
 {
 	abortPoll_ = true;
+	uint64_t one = 1;
+	if (write(abort_event_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG(1, "Failed to signal poll thread");
 	poll_thread_.join();
-	abortOutput_ = true;
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+		output_cond_var_.notify_one();
+	}
 	output_thread_.join();
 
+	// The application should have let go of all the encoded buffers by now, but give it a
+	// moment. After this, any late releases will just be ignored.
+	bool buffers_returned;
+	{
+		using namespace std::chrono_literals;
+		std::unique_lock<std::mutex> lock(capture_buffers_->mutex);
+		buffers_returned = capture_buffers_->cond_var.wait_for(lock, 1s,
+															   [this] { return !capture_buffers_->dequeued; });
+		capture_buffers_->closed = true;
+	}
+	if (!buffers_returned)
+		LOG_ERROR("H264: encoded buffers still in use, not unmapping them");
+
 	// Turn off streaming on both the output and capture queues, and "free" the
 	// buffers that we requested. The capture ones need to be "munmapped" first.
 
@@ -229,8 +269,8 @@ H264Encoder::~H264Encoder()
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		LOG(1, "Request to free output buffers failed");
 
-	for (int i = 0; i < num_capture_buffers_; i++)
-		if (munmap(buffers_[i].mem, buffers_[i].size) < 0)
+	for (auto &buffer : buffers_)
+		if (buffers_returned && munmap(buffer.mem, buffer.size) < 0)
 			LOG(1, "Failed to unmap buffer");
 	reqbufs = {};
 	reqbufs.count = 0;
@@ -239,21 +279,66 @@ H264Encoder::~H264Encoder()
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		LOG(1, "Request to free capture buffers failed");
 
+	close(abort_event_fd_);
 	close(fd_);
+	if (dropped_frames_)
+		LOG(1, "H264: dropped " << dropped_frames_ << " frames because the encoder was full");
 	LOG(2, "H264Encoder closed");
 }
 
-void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+bool H264Encoder::SetBitrate(unsigned int bitrate_bps)
 {
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+	ctrl.value = bitrate_bps;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+	{
+		LOG_ERROR("H264: failed to set bitrate " << bitrate_bps);
+		return false;
+	}
+	LOG(2, "H264: bitrate set to " << bitrate_bps);
+	return true;
+}
+
+bool H264Encoder::SetIntraPeriod(unsigned int frames)
+{
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+	ctrl.value = frames;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+	{
+		LOG_ERROR("H264: failed to set intra period " << frames);
+		return false;
+	}
+	LOG(2, "H264: intra period set to " << frames);
+	return true;
+}
+
+void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+							   bool force_keyframe)
+{
+	// We need to find an available output buffer (input to the codec) to "wrap" the DMABUF.
 	int index;
+	if (!getInputBuffer(index, mem))
+	{
+		// The dropped frame can go straight back. Its metadata is discarded by the output,
+		// which never sees the frame.
+		input_done_callback_(mem);
+		return;
+	}
+	// The codec has no control for adjusting the quality of parts of the image.
+	if (!regions_of_interest_.empty() && !roi_warned_)
 	{
-		// We need to find an available output buffer (input to the codec) to
-		// "wrap" the DMABUF.
-		std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
-		if (input_buffers_available_.empty())
-			throw std::runtime_error("no buffers available to queue codec input");
-		index = input_buffers_available_.front();
-		input_buffers_available_.pop();
+		LOG(1, "H264: regions of interest are not supported by this encoder");
+		roi_warned_ = true;
+	}
+	if (keyframeRequested(force_keyframe))
+	{
+		v4l2_control ctrl = {};
+		ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+		ctrl.value = 1;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			LOG(1, "H264: failed to force keyframe");
 	}
 	v4l2_buffer buf = {};
 	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
@@ -272,24 +357,53 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 		throw std::runtime_error("failed to queue input to codec");
 }
 
+bool H264Encoder::getInputBuffer(int &index, void *mem)
+{
+	{
+		std::unique_lock<std::mutex> lock(input_buffers_available_mutex_);
+		if (backpressure_wait_)
+			input_buffers_available_cond_var_.wait_for(lock,
+													   std::chrono::milliseconds(options_->backpressure_timeout),
+													   [this] { return !input_buffers_available_.empty(); });
+		if (!input_buffers_available_.empty())
+		{
+			index = input_buffers_available_.front();
+			input_buffers_available_.pop();
+			input_mem_[index] = mem;
+			return true;
+		}
+
+		dropped_frames_++;
+	}
+
+	LOG(2, "H264: encoder full, dropping frame");
+	return false;
+}
+
 void H264Encoder::pollThread()
 {
+	pollfd p[2] = { { fd_, POLLIN, 0 }, { abort_event_fd_, POLLIN, 0 } };
 	while (true)
 	{
-		pollfd p = { fd_, POLLIN, 0 };
-		int ret = poll(&p, 1, 200);
 		{
 			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
-			if (abortPoll_ && input_buffers_available_.size() == NUM_OUTPUT_BUFFERS)
+			if (abortPoll_ && input_buffers_available_.size() == num_output_buffers_)
 				break;
 		}
+		int ret = poll(p, 2, -1);
 		if (ret == -1)
 		{
 			if (errno == EINTR)
 				continue;
 			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from poll");
 		}
-		if (p.revents & POLLIN)
+		if (p[1].revents & POLLIN)
+		{
+			// Just clear the event; we don't stop until all the input buffers are back.
+			uint64_t count;
+			[[maybe_unused]] ssize_t r = read(abort_event_fd_, &count, sizeof(count));
+		}
+		if (p[0].revents & POLLIN)
 		{
 			v4l2_buffer buf = {};
 			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
@@ -302,11 +416,14 @@ void H264Encoder::pollThread()
 			{
 				// Return this to the caller, first noting that this buffer, identified
 				// by its index, is available for queueing up another frame.
+				void *mem;
 				{
 					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
 					input_buffers_available_.push(buf.index);
+					mem = input_mem_[buf.index];
+					input_buffers_available_cond_var_.notify_one();
 				}
-				input_done_callback_(nullptr);
+				input_done_callback_(mem);
 			}
 
 			buf = {};
@@ -321,6 +438,10 @@ void H264Encoder::pollThread()
 				// We push this encoded buffer to another thread so that our
 				// application can take its time with the data without blocking the
 				// encode process.
+				{
+					std::lock_guard<std::mutex> lock(capture_buffers_->mutex);
+					capture_buffers_->dequeued++;
+				}
 				int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
 				OutputItem item = { buffers_[buf.index].mem,
 									buf.m.planes[0].bytesused,
@@ -342,37 +463,84 @@ void H264Encoder::outputThread()
 	while (true)
 	{
 		{
+			// Items still in the output queue when we abort must all get their callbacks.
 			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				// Must check the abort first, to allow items in the output
-				// queue to have a callback.
-				if (abortOutput_ && output_queue_.empty())
-					return;
-
-				if (!output_queue_.empty())
-				{
-					item = output_queue_.front();
-					output_queue_.pop();
-					break;
-				}
-				else
-					output_cond_var_.wait_for(lock, 200ms);
-			}
+			output_cond_var_.wait(lock, [this] { return abortOutput_ || !output_queue_.empty(); });
+			if (output_queue_.empty())
+				return;
+			item = output_queue_.front();
+			output_queue_.pop();
 		}
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe);
-		v4l2_buffer buf = {};
-		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = item.index;
-		buf.length = 1;
-		buf.m.planes = planes;
-		buf.m.planes[0].bytesused = 0;
-		buf.m.planes[0].length = item.length;
-		if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
-			throw std::runtime_error("failed to re-queue encoded buffer");
+		// If the application doesn't keep the buffer, it goes straight back to the codec.
+		outputBuffer(makeEncodedBuffer(item));
+	}
+}
+
+EncodedBufferPtr H264Encoder::makeEncodedBuffer(OutputItem const &item)
+{
+	std::shared_ptr<CaptureBuffers> capture_buffers = capture_buffers_;
+	bool copy = false;
+	if (options_->h264_copy_threshold)
+	{
+		std::lock_guard<std::mutex> lock(capture_buffers->mutex);
+		copy = buffers_.size() - capture_buffers->dequeued < options_->h264_copy_threshold;
+	}
+
+	if (!copy)
+	{
+		unsigned int index = item.index;
+		size_t length = item.length;
+		return EncodedBufferPtr(new EncodedBuffer { item.mem, item.bytes_used, item.timestamp_us, item.keyframe },
+								[capture_buffers, index, length](EncodedBuffer *buffer) {
+									capture_buffers->requeue(index, length);
+									delete buffer;
+								});
+	}
+
+	EncodedBufferPtr copied = copy_encoded_buffer(
+		item.mem, item.bytes_used, item.timestamp_us, item.keyframe, capture_buffers->getCopyBuffer(item.bytes_used),
+		[capture_buffers](std::vector<uint8_t> &&data) {
+			std::lock_guard<std::mutex> lock(capture_buffers->mutex);
+			capture_buffers->copy_pool.push_back(std::move(data));
+		});
+	capture_buffers->requeue(item.index, item.length);
+	return copied;
+}
+
+void H264Encoder::CaptureBuffers::requeue(unsigned int index, size_t length)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	dequeued--;
+	cond_var.notify_all();
+	if (closed)
+		return;
+
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+	buf.length = 1;
+	buf.m.planes = planes;
+	buf.m.planes[0].bytesused = 0;
+	buf.m.planes[0].length = length;
+	// This may run in any thread that drops the last reference, so don't throw.
+	if (xioctl(fd, VIDIOC_QBUF, &buf) < 0)
+		LOG_ERROR("H264: failed to re-queue encoded buffer");
+}
+
+std::vector<uint8_t> H264Encoder::CaptureBuffers::getCopyBuffer(size_t size)
+{
+	std::vector<uint8_t> buffer;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!copy_pool.empty())
+		{
+			buffer = std::move(copy_pool.back());
+			copy_pool.pop_back();
+		}
 	}
+	buffer.resize(size);
+	return buffer;
 }
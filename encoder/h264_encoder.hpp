@@ -7,10 +7,13 @@
 
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 #include "encoder.hpp"
 
@@ -20,15 +23,17 @@ public:
 	H264Encoder(VideoOptions const *options, StreamInfo const &info);
 	~H264Encoder();
 	// Encode the given DMABUF.
-	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+					  bool force_keyframe) override;
+	bool SetBitrate(unsigned int bitrate_bps) override;
+	bool SetIntraPeriod(unsigned int frames) override;
 
 private:
 	// We want at least as many output buffers as there are in the camera queue
 	// (we always want to be able to queue them when they arrive). Make loads
 	// of capture buffers, as this is our buffering mechanism in case of delays
-	// dealing with the output bitstream.
-	static constexpr int NUM_OUTPUT_BUFFERS = 6;
-	static constexpr int NUM_CAPTURE_BUFFERS = 12;
+	// dealing with the output bitstream. Both numbers can be changed with the
+	// h264-input-buffers and h264-output-buffers options.
 
 	// This thread just sits waiting for the encoder to finish stuff. It will either:
 	// * receive "output" buffers (codec inputs), which we must return to the caller
@@ -40,19 +45,30 @@ private:
 	// re-use.
 	void outputThread();
 
-	bool abortPoll_;
+	// If the codec has no free input buffers, we wait for one (if that's the policy) and
+	// drop the frame otherwise. We record which camera buffer each codec buffer is wrapping,
+	// so that we can say which one is finished when the codec gives it back.
+	bool getInputBuffer(int &index, void *mem);
+
+	std::atomic<bool> abortPoll_;
 	bool abortOutput_;
 	int fd_;
+	int abort_event_fd_;
 	struct BufferDescription
 	{
 		void *mem;
 		size_t size;
 	};
-	BufferDescription buffers_[NUM_CAPTURE_BUFFERS];
-	int num_capture_buffers_;
+	std::vector<BufferDescription> buffers_;
+	unsigned int num_output_buffers_;
 	std::thread poll_thread_;
 	std::mutex input_buffers_available_mutex_;
+	std::condition_variable input_buffers_available_cond_var_;
 	std::queue<int> input_buffers_available_;
+	std::vector<void *> input_mem_;
+	bool backpressure_wait_;
+	unsigned int dropped_frames_;
+	bool roi_warned_;
 	struct OutputItem
 	{
 		void *mem;
@@ -62,6 +78,26 @@ private:
 		bool keyframe;
 		int64_t timestamp_us;
 	};
+
+	// The encoded frames are passed to the application in EncodedBuffers that refer directly
+	// to our capture buffers, which go back to the codec when the last reference is dropped.
+	// If the application is holding so many that the codec is running short, we copy the
+	// frame out instead (into a buffer from a pool) and return the capture buffer at once.
+	// This state is shared with the EncodedBuffers, so that they remain safe to release
+	// even after we've closed.
+	struct CaptureBuffers
+	{
+		void requeue(unsigned int index, size_t length);
+		std::vector<uint8_t> getCopyBuffer(size_t size);
+		std::mutex mutex;
+		std::condition_variable cond_var;
+		int fd;
+		bool closed = false;
+		unsigned int dequeued = 0; // number not queued in the codec
+		std::vector<std::vector<uint8_t>> copy_pool;
+	};
+	EncodedBufferPtr makeEncodedBuffer(OutputItem const &item);
+	std::shared_ptr<CaptureBuffers> capture_buffers_;
 	std::queue<OutputItem> output_queue_;
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
@@ -7,13 +7,17 @@
 
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <libdrm/drm_fourcc.h>
 #include <linux/videodev2.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <iostream>
 
 #include "libav_encoder.hpp"
@@ -52,6 +56,20 @@ void encoderOptionsLibx264(VideoOptions const *options, AVCodecContext *codec)
 	av_opt_set(codec->priv_data, "sc_threshold", "0", 0);
 	av_opt_set(codec->priv_data, "rc-lookahead", "0", 0);
 	av_opt_set(codec->priv_data, "mixed_ref", "0", 0);
+	av_opt_set(codec->priv_data, "forced-idr", "1", 0);
+
+	// Frame threads each hold a frame, adding a frame of latency per thread. Slice threads
+	// share out the work within each frame instead. Intra refresh spreads the cost of a
+	// keyframe across many frames, avoiding the burst (and delay) of a large IDR frame, but
+	// requested keyframes are still full IDRs.
+	if (options->libav_latency == "low")
+	{
+		codec->max_b_frames = 0;
+		codec->thread_type = FF_THREAD_SLICE;
+		codec->slices = 0;
+		av_opt_set(codec->priv_data, "tune", "zerolatency", 0);
+		av_opt_set(codec->priv_data, "intra-refresh", "1", 0);
+	}
 }
 
 const std::map<std::string, std::function<void(VideoOptions const *, AVCodecContext *)>> optionsMap =
@@ -60,6 +78,31 @@ const std::map<std::string, std::function<void(VideoOptions const *, AVCodecCont
 	{ "libx264", encoderOptionsLibx264 },
 };
 
+// Codecs that understand this side data (such as libx264) adjust their quantiser within
+// each region; others just ignore it. It's freed when the frame is unreffed.
+void addRegionsOfInterest(AVFrame *frame, RegionsOfInterest const &regions, StreamInfo const &info)
+{
+	AVFrameSideData *side_data = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+														regions.size() * sizeof(AVRegionOfInterest));
+	if (!side_data)
+	{
+		LOG_ERROR("libav: unable to add regions of interest");
+		return;
+	}
+
+	AVRegionOfInterest *roi = (AVRegionOfInterest *)side_data->data;
+	for (auto const &region : regions)
+	{
+		roi->self_size = sizeof(AVRegionOfInterest);
+		roi->left = std::clamp<int>(region.x * info.width, 0, info.width);
+		roi->right = std::clamp<int>((region.x + region.width) * info.width, 0, info.width);
+		roi->top = std::clamp<int>(region.y * info.height, 0, info.height);
+		roi->bottom = std::clamp<int>((region.y + region.height) * info.height, 0, info.height);
+		roi->qoffset = av_make_q(std::clamp<int>(region.qoffset * 1000, -1000, 1000), 1000);
+		roi++;
+	}
+}
+
 } // namespace
 
 void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const &info)
@@ -277,7 +320,9 @@ void LibAvEncoder::initAudioOutCodec(VideoOptions const *options, StreamInfo con
 
 LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 	: Encoder(options), output_ready_(false), abort_video_(false), abort_audio_(false),
-	  video_start_ts_(0), audio_samples_(0), in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr)
+	  video_start_ts_(0), audio_samples_(0), pending_bitrate_(0), intra_period_(0), frames_since_keyframe_(0),
+	  in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr), abort_writer_(false), audio_underruns_(0), audio_overruns_(0),
+	  latency_sum_(0), latency_max_(0), latency_count_(0)
 {
 	avdevice_register_all();
 
@@ -296,6 +341,10 @@ LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 
 	LOG(2, "libav: codec init completed");
 
+	writer_event_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (writer_event_fd_ < 0)
+		throw std::runtime_error("libav: failed to create eventfd");
+	writer_thread_ = std::thread(&LibAvEncoder::writerThread, this);
 	video_thread_ = std::thread(&LibAvEncoder::videoThread, this);
 
 	if (options->libav_audio)
@@ -313,8 +362,29 @@ LibAvEncoder::~LibAvEncoder()
 	abort_video_ = true;
 	video_thread_.join();
 
+	// All the packets have been queued, so the writer can finish.
+	abort_writer_ = true;
+	signalWriter();
+	writer_thread_.join();
+	close(writer_event_fd_);
+	for (auto &queue : packet_queue_)
+	{
+		AVPacket *pkt;
+		while (queue.free.Pop(pkt))
+			av_packet_free(&pkt);
+	}
+
+	if (packet_queue_[Video].overruns || packet_queue_[AudioOut].overruns)
+		LOG(1, "libav: " << packet_queue_[Video].overruns << " video and " << packet_queue_[AudioOut].overruns
+						 << " audio packets waited for the writer");
+	if (audio_underruns_ || audio_overruns_)
+		LOG(1, "libav: audio had " << audio_underruns_ << " underruns (lost input) and " << audio_overruns_
+								   << " overruns (dropped samples)");
+
 	avformat_free_context(out_fmt_ctx_);
 	avcodec_free_context(&codec_ctx_[Video]);
+	for (AVFrame *frame : frame_pool_)
+		av_frame_free(&frame);
 
 	if (options_->libav_audio)
 	{
@@ -326,11 +396,50 @@ LibAvEncoder::~LibAvEncoder()
 	LOG(2, "libav: codec closed");
 }
 
-void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+bool LibAvEncoder::SetBitrate(unsigned int bitrate_bps)
 {
-	AVFrame *frame = av_frame_alloc();
-	if (!frame)
-		throw std::runtime_error("libav: could not allocate AVFrame");
+	// Of our codecs, only libx264 reconfigures itself when the bitrate changes.
+	if (strcmp(codec_ctx_[Video]->codec->name, "libx264"))
+	{
+		LOG_ERROR("libav: codec " << codec_ctx_[Video]->codec->name << " can't change bitrate while running");
+		return false;
+	}
+	// Without --bitrate libx264 was opened in CRF mode, where a target bitrate has no effect.
+	if (!options_->bitrate)
+	{
+		LOG_ERROR("libav: libx264 is in constant quality mode, so its bitrate can't be changed");
+		return false;
+	}
+	pending_bitrate_ = bitrate_bps;
+	return true;
+}
+
+bool LibAvEncoder::SetIntraPeriod(unsigned int frames)
+{
+	// We can only force extra keyframes, so this can't lengthen the codec's own GOP.
+	if (frames > (unsigned int)codec_ctx_[Video]->gop_size)
+		LOG(1, "libav: intra period " << frames << " is longer than the GOP size " << codec_ctx_[Video]->gop_size);
+	intra_period_ = frames;
+	return true;
+}
+
+void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+								bool force_keyframe)
+{
+	auto now = std::chrono::steady_clock::now();
+	AVFrame *frame = getFrame();
+	InputBuffer *input;
+	{
+		std::scoped_lock<std::mutex> lock(input_mutex_);
+		std::unique_ptr<InputBuffer> &slot = input_buffers_[fd];
+		if (!slot)
+		{
+			slot = std::make_unique<InputBuffer>();
+			slot->encoder = this;
+		}
+		input = slot.get();
+		input->mem = mem;
+	}
 
 	if (!video_start_ts_)
 		video_start_ts_ = timestamp_us;
@@ -342,16 +451,23 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	frame->linesize[1] = frame->linesize[2] = info.stride >> 1;
 	frame->pts = timestamp_us - video_start_ts_ +
 				 (options_->av_sync.value < 0us ? -options_->av_sync.get<std::chrono::microseconds>() : 0);
+	// Codecs take this as a request to make an I (IDR, for libx264 with forced-idr) frame.
+	unsigned int intra_period = intra_period_;
+	if (keyframeRequested(force_keyframe) || (intra_period && ++frames_since_keyframe_ >= intra_period))
+	{
+		frame->pict_type = AV_PICTURE_TYPE_I;
+		frames_since_keyframe_ = 0;
+	}
+	if (!regions_of_interest_.empty())
+		addRegionsOfInterest(frame, regions_of_interest_, info);
 
 	if (codec_ctx_[Video]->pix_fmt == AV_PIX_FMT_DRM_PRIME)
 	{
-		std::scoped_lock<std::mutex> lock(drm_queue_lock_);
-		drm_frame_queue_.emplace(std::make_unique<AVDRMFrameDescriptor>());
-		frame->buf[0] = av_buffer_create((uint8_t *)drm_frame_queue_.back().get(), sizeof(AVDRMFrameDescriptor),
-										 &LibAvEncoder::releaseBuffer, this, 0);
+		AVDRMFrameDescriptor *desc = &input->desc;
+		frame->buf[0] = av_buffer_create((uint8_t *)desc, sizeof(AVDRMFrameDescriptor), &LibAvEncoder::releaseBuffer,
+										 input, 0);
 		frame->data[0] = frame->buf[0]->data;
 
-		AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
 		desc->nb_objects = 1;
 		desc->objects[0].fd = fd;
 		desc->objects[0].size = size;
@@ -372,12 +488,13 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	}
 	else
 	{
-		frame->buf[0] = av_buffer_create((uint8_t *)mem, size, &LibAvEncoder::releaseBuffer, this, 0);
+		frame->buf[0] = av_buffer_create((uint8_t *)mem, size, &LibAvEncoder::releaseBuffer, input, 0);
 		av_image_fill_pointers(frame->data, AV_PIX_FMT_YUV420P, frame->height, frame->buf[0]->data, frame->linesize);
 		av_frame_make_writable(frame);
 	}
 
 	std::scoped_lock<std::mutex> lock(video_mutex_);
+	frame_times_[frame->pts] = now;
 	frame_queue_.push(frame);
 	video_cv_.notify_all();
 }
@@ -417,7 +534,9 @@ void LibAvEncoder::initOutput()
 
 void LibAvEncoder::deinitOutput()
 {
-	if (!out_fmt_ctx_)
+	// If no frame was ever encoded (which is normal when recording is gated) then the output
+	// was never opened and no header written, so there is nothing to finish off.
+	if (!out_fmt_ctx_ || !output_ready_)
 		return;
 
 	av_write_trailer(out_fmt_ctx_);
@@ -442,6 +561,9 @@ void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
 		else if (ret < 0)
 			throw std::runtime_error("libav: error receiving packet: " + std::to_string(ret));
 
+		if (stream_id == Video)
+			recordLatency(pkt->pts, pkt->dts);
+
 		// Initialise the ouput mux on the first received video packet, as we may need
 		// to copy global header data from the encoder.
 		if (stream_id == Video && !output_ready_)
@@ -457,26 +579,147 @@ void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
 		// Rescale from the codec timebase to the stream timebase.
 		av_packet_rescale_ts(pkt, codec_ctx_[stream_id]->time_base, out_fmt_ctx_->streams[stream_id]->time_base);
 
-		std::scoped_lock<std::mutex> lock(output_mutex_);
-		// pkt is now blank (av_interleaved_write_frame() takes ownership of
-		// its contents and resets pkt), so that no unreferencing is necessary.
-		// This would be different if one used av_write_frame().
-		ret = av_interleaved_write_frame(out_fmt_ctx_, pkt);
-		if (ret < 0)
-			throw std::runtime_error("libav: error writing output: " + std::to_string(ret));
+		queuePacket(pkt, stream_id);
+	}
+}
+
+void LibAvEncoder::queuePacket(AVPacket *pkt, unsigned int stream_id)
+{
+	PacketQueue &queue = packet_queue_[stream_id];
+	AVPacket *queued;
+	if (!queue.free.Pop(queued) && !(queued = av_packet_alloc()))
+		throw std::runtime_error("libav: unable to allocate packet");
+	// pkt is now blank, ready for the next one from the codec.
+	av_packet_move_ref(queued, pkt);
+
+	// If the writer has fallen this far behind, there's nothing for it but to wait.
+	if (!queue.queued.Push(queued))
+	{
+		queue.overruns++;
+		while (!queue.queued.Push(queued))
+		{
+			signalWriter();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
 	}
+	signalWriter();
+}
+
+bool LibAvEncoder::nextPacket(AVPacket *&pkt, unsigned int &stream_id)
+{
+	// Take whichever stream's packet comes first, leaving av_interleaved_write_frame to do
+	// the rest of the interleaving.
+	AVPacket **video = packet_queue_[Video].queued.Front();
+	AVPacket **audio = packet_queue_[AudioOut].queued.Front();
+	if (video && audio)
+		stream_id = av_compare_ts((*video)->dts, out_fmt_ctx_->streams[Video]->time_base, (*audio)->dts,
+								  out_fmt_ctx_->streams[AudioOut]->time_base) <= 0
+						? Video
+						: AudioOut;
+	else if (video)
+		stream_id = Video;
+	else if (audio)
+		stream_id = AudioOut;
+	else
+		return false;
+
+	return packet_queue_[stream_id].queued.Pop(pkt);
+}
+
+void LibAvEncoder::signalWriter()
+{
+	uint64_t one = 1;
+	if (write(writer_event_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG_ERROR("libav: failed to signal writer thread");
+}
+
+void LibAvEncoder::writerThread()
+{
+	AVPacket *pkt;
+	unsigned int stream_id;
+
+	while (true)
+	{
+		uint64_t count;
+		if (read(writer_event_fd_, &count, sizeof(count)) != sizeof(count))
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("libav: failed to read eventfd");
+		}
+
+		while (nextPacket(pkt, stream_id))
+		{
+			// pkt is now blank (av_interleaved_write_frame() takes ownership of
+			// its contents and resets pkt), so that no unreferencing is necessary.
+			// This would be different if one used av_write_frame().
+			int ret = av_interleaved_write_frame(out_fmt_ctx_, pkt);
+			if (ret < 0)
+				throw std::runtime_error("libav: error writing output: " + std::to_string(ret));
+			if (!packet_queue_[stream_id].free.Push(pkt))
+				av_packet_free(&pkt);
+		}
+
+		// Everything has been queued before we're told to stop, so it's all written now.
+		if (abort_writer_)
+			break;
+	}
+
+	deinitOutput();
+}
+
+void LibAvEncoder::recordLatency(int64_t pts, int64_t dts)
+{
+	std::chrono::steady_clock::time_point start;
+	{
+		std::scoped_lock<std::mutex> lock(video_mutex_);
+		// Every packet's pts is at least its dts, and packets come out in dts order, so a frame
+		// with a pts before this packet's dts must already have come out, or never will.
+		if (dts != AV_NOPTS_VALUE)
+			frame_times_.erase(frame_times_.begin(), frame_times_.lower_bound(std::min(pts, dts)));
+		auto it = frame_times_.find(pts);
+		if (it == frame_times_.end())
+			return;
+		start = it->second;
+		frame_times_.erase(it);
+	}
+
+	std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - start;
+	latency_sum_ += latency.count();
+	latency_max_ = std::max(latency_max_, latency.count());
+	latency_count_++;
 }
 
 extern "C" void LibAvEncoder::releaseBuffer(void *opaque, uint8_t *data)
 {
-	LibAvEncoder *enc = static_cast<LibAvEncoder *>(opaque);
+	InputBuffer *input = static_cast<InputBuffer *>(opaque);
+	input->encoder->input_done_callback_(input->mem);
+}
 
-	enc->input_done_callback_(nullptr);
+AVFrame *LibAvEncoder::getFrame()
+{
+	{
+		std::scoped_lock<std::mutex> lock(input_mutex_);
+		if (!frame_pool_.empty())
+		{
+			AVFrame *frame = frame_pool_.back();
+			frame_pool_.pop_back();
+			return frame;
+		}
+	}
 
-	// Pop the entry from the queue to release the AVDRMFrameDescriptor allocation
-	std::scoped_lock<std::mutex> lock(enc->drm_queue_lock_);
-	if (!enc->drm_frame_queue_.empty())
-		enc->drm_frame_queue_.pop();
+	AVFrame *frame = av_frame_alloc();
+	if (!frame)
+		throw std::runtime_error("libav: could not allocate AVFrame");
+	return frame;
+}
+
+void LibAvEncoder::returnFrame(AVFrame *frame)
+{
+	// This drops our reference to the camera buffer, and resets the frame for re-use.
+	av_frame_unref(frame);
+	std::scoped_lock<std::mutex> lock(input_mutex_);
+	frame_pool_.push_back(frame);
 }
 
 void LibAvEncoder::videoThread()
@@ -507,12 +750,19 @@ void LibAvEncoder::videoThread()
 			}
 		}
 
+		unsigned int bitrate = pending_bitrate_.exchange(0);
+		if (bitrate)
+		{
+			codec_ctx_[Video]->bit_rate = bitrate;
+			LOG(2, "libav: bitrate set to " << bitrate);
+		}
+
 		int ret = avcodec_send_frame(codec_ctx_[Video], frame);
 		if (ret < 0)
 			throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
 
 		encode(pkt, Video);
-		av_frame_free(&frame);
+		returnFrame(frame);
 	}
 
 done:
@@ -521,7 +771,10 @@ done:
 	encode(pkt, Video);
 
 	av_packet_free(&pkt);
-	deinitOutput();
+
+	if (latency_count_)
+		LOG(2, "libav: encoded " << latency_count_ << " frames, latency mean " << latency_sum_ / latency_count_
+								 << "ms, max " << latency_max_ << "ms");
 }
 
 void LibAvEncoder::audioThread()
@@ -575,6 +828,24 @@ void LibAvEncoder::audioThread()
 	if (ret < 0)
 		throw std::runtime_error("libav: failed to alloc sample array");
 
+	// The output frame is allocated just once. If the codec still holds a reference to its
+	// buffer when we come to fill it again, av_frame_make_writable gives us a new one.
+	AVFrame *out_frame = av_frame_alloc();
+	out_frame->nb_samples = codec_ctx_[AudioOut]->frame_size;
+#if LIBAVUTIL_VERSION_MAJOR < 57
+	out_frame->channels = codec_ctx_[AudioOut]->channels;
+	out_frame->channel_layout = av_get_default_channel_layout(codec_ctx_[AudioOut]->channels);
+#else
+	av_channel_layout_copy(&out_frame->ch_layout, &codec_ctx_[AudioOut]->ch_layout);
+#endif
+	out_frame->format = required_fmt;
+	out_frame->sample_rate = codec_ctx_[AudioOut]->sample_rate;
+	if (av_frame_get_buffer(out_frame, 0) < 0)
+		throw std::runtime_error("libav: failed to alloc audio frame");
+
+	// Where we expect the next input packet to start, in microseconds.
+	int64_t next_in_pts_us = AV_NOPTS_VALUE;
+
 	while (!abort_audio_)
 	{
 		// Audio In
@@ -590,6 +861,19 @@ void LibAvEncoder::audioThread()
 		if (ret && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
 			throw std::runtime_error("libav: error getting decoded audio in frame");
 
+		// A gap before this packet means the source lost some audio.
+		if (!ret && in_pkt->pts != AV_NOPTS_VALUE)
+		{
+			int64_t pts_us = av_rescale_q(in_pkt->pts, stream_[AudioIn]->time_base, { 1, 1000 * 1000 });
+			int64_t duration_us = av_rescale(in_frame->nb_samples, 1000 * 1000, codec_ctx_[AudioIn]->sample_rate);
+			if (next_in_pts_us != AV_NOPTS_VALUE && pts_us - next_in_pts_us > duration_us)
+			{
+				audio_underruns_++;
+				LOG(2, "libav: audio underrun, " << pts_us - next_in_pts_us << "us of input missing");
+			}
+			next_in_pts_us = pts_us + duration_us;
+		}
+
 		// Audio Resample/Conversion
 		int num_output_samples =
 			av_rescale_rnd(swr_get_delay(conv, codec_ctx_[AudioIn]->sample_rate) + in_frame->nb_samples,
@@ -629,6 +913,7 @@ void LibAvEncoder::audioThread()
 		{
 			LOG(1, "libav: Draining audio fifo, configure a larger size");
 			av_audio_fifo_drain(fifo, num_output_samples);
+			audio_overruns_++;
 		}
 
 		av_audio_fifo_write(fifo, (void **)samples, num_output_samples);
@@ -643,20 +928,8 @@ void LibAvEncoder::audioThread()
 		// Audio Out
 		while (av_audio_fifo_size(fifo) >= codec_ctx_[AudioOut]->frame_size)
 		{
-			AVFrame *out_frame = av_frame_alloc();
-			out_frame->nb_samples = codec_ctx_[AudioOut]->frame_size;
-
-#if LIBAVUTIL_VERSION_MAJOR < 57
-			out_frame->channels = codec_ctx_[AudioOut]->channels;
-			out_frame->channel_layout = av_get_default_channel_layout(codec_ctx_[AudioOut]->channels);
-#else
-			av_channel_layout_copy(&out_frame->ch_layout, &codec_ctx_[AudioOut]->ch_layout);
-#endif
-
-			out_frame->format = required_fmt;
-			out_frame->sample_rate = codec_ctx_[AudioOut]->sample_rate;
-
-			av_frame_get_buffer(out_frame, 0);
+			if (av_frame_make_writable(out_frame) < 0)
+				throw std::runtime_error("libav: unable to write audio frame");
 			av_audio_fifo_read(fifo, (void **)out_frame->data, codec_ctx_[AudioOut]->frame_size);
 
 			AVRational num = { 1, out_frame->sample_rate };
@@ -671,7 +944,6 @@ void LibAvEncoder::audioThread()
 				throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
 
 			encode(out_pkt, AudioOut);
-			av_frame_free(&out_frame);
 		}
 	}
 
@@ -686,4 +958,5 @@ void LibAvEncoder::audioThread()
 	av_packet_free(&in_pkt);
 	av_packet_free(&out_pkt);
 	av_frame_free(&in_frame);
+	av_frame_free(&out_frame);
 }
@@ -8,11 +8,14 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 extern "C"
 {
@@ -28,6 +31,8 @@ extern "C"
 #include "libswresample/swresample.h"
 }
 
+#include "core/spsc_queue.hpp"
+
 #include "encoder.hpp"
 
 class LibAvEncoder : public Encoder
@@ -36,7 +41,10 @@ public:
 	LibAvEncoder(VideoOptions const *options, StreamInfo const &info);
 	~LibAvEncoder();
 	// Encode the given DMABUF.
-	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+					  bool force_keyframe) override;
+	bool SetBitrate(unsigned int bitrate_bps) override;
+	bool SetIntraPeriod(unsigned int frames) override;
 
 private:
 	void initVideoCodec(VideoOptions const *options, StreamInfo const &info);
@@ -58,13 +66,46 @@ private:
 	uint64_t video_start_ts_;
 	uint64_t audio_samples_;
 
+	// Runtime changes. A new bitrate is picked up by the video thread before the next frame
+	// is sent to the codec. The GOP length is fixed once the codec is open, so a new intra
+	// period is applied by forcing keyframes ourselves.
+	std::atomic<unsigned int> pending_bitrate_;
+	std::atomic<unsigned int> intra_period_;
+	unsigned int frames_since_keyframe_;
+
 	std::queue<AVFrame *> frame_queue_;
 	std::mutex video_mutex_;
-	std::mutex output_mutex_;
 	std::condition_variable video_cv_;
 	std::thread video_thread_;
 	std::thread audio_thread_;
 
+	// Encoded packets go to a single thread that writes them to the muxer, so that the video
+	// and audio threads never wait for each other's writes. Each stream has a lock-free queue
+	// of packets for the writer, and another bringing empty packets back for re-use. The
+	// writer sleeps on the eventfd until there are packets to write.
+	void queuePacket(AVPacket *pkt, unsigned int stream_id);
+	bool nextPacket(AVPacket *&pkt, unsigned int &stream_id);
+	void signalWriter();
+	void writerThread();
+	static constexpr unsigned int PACKET_QUEUE_SIZE = 64;
+	struct PacketQueue
+	{
+		PacketQueue() : queued(PACKET_QUEUE_SIZE), free(PACKET_QUEUE_SIZE), overruns(0) {}
+		SpscQueue<AVPacket *> queued;
+		SpscQueue<AVPacket *> free;
+		// Packets that had to wait because the writer was this far behind.
+		unsigned int overruns;
+	};
+	PacketQueue packet_queue_[2];
+	int writer_event_fd_;
+	std::atomic<bool> abort_writer_;
+	std::thread writer_thread_;
+
+	// Audio input lost by the source (gaps in its timestamps), and audio we had to throw
+	// away because the encoder couldn't keep up.
+	unsigned int audio_underruns_;
+	unsigned int audio_overruns_;
+
 	// The ordering in the enum below must not change!
 	enum Context { Video = 0, AudioOut = 1, AudioIn = 2 };
 	AVCodecContext *codec_ctx_[3];
@@ -72,6 +113,29 @@ private:
 	AVFormatContext *in_fmt_ctx_;
 	AVFormatContext *out_fmt_ctx_;
 
-	std::mutex drm_queue_lock_;
-	std::queue<std::unique_ptr<AVDRMFrameDescriptor>> drm_frame_queue_;
+	// Everything we need to wrap a camera buffer is kept and re-used, so that normally we
+	// allocate nothing per frame. Frames are pooled, and there's an InputBuffer (holding the
+	// DRM descriptor) for each camera buffer, keyed by its dmabuf fd. The codec may let go of
+	// buffers in any order, so each InputBuffer records its camera buffer's address, which
+	// tells the application which one has finished.
+	struct InputBuffer
+	{
+		LibAvEncoder *encoder;
+		void *mem;
+		AVDRMFrameDescriptor desc;
+	};
+	AVFrame *getFrame();
+	void returnFrame(AVFrame *frame);
+	std::mutex input_mutex_;
+	std::vector<AVFrame *> frame_pool_;
+	std::map<int, std::unique_ptr<InputBuffer>> input_buffers_;
+
+	// The time each frame was passed to us (by pts), so that we can measure the latency
+	// until its packet comes out of the codec. Frames the codec never returns are forgotten
+	// once packets are coming out in decode order after them.
+	void recordLatency(int64_t pts, int64_t dts);
+	std::map<int64_t, std::chrono::steady_clock::time_point> frame_times_;
+	double latency_sum_;
+	double latency_max_;
+	unsigned int latency_count_;
 };
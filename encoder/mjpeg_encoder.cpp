@@ -5,189 +5,252 @@
  * mjpeg_encoder.cpp - mjpeg video encoder.
  */
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
 #include <iostream>
 
-#include <jpeglib.h>
+#include "image/jpeg_slices.hpp"
 
 #include "mjpeg_encoder.hpp"
 
-#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
-typedef size_t jpeg_mem_len_t;
-#else
-typedef unsigned long jpeg_mem_len_t;
-#endif
-
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0), expected_size_(0), output_index_(0),
+	  output_failed_(false)
 {
+	num_threads_ = options->mjpeg_threads ? options->mjpeg_threads : std::thread::hardware_concurrency();
+	num_threads_ = std::max(num_threads_, 1u);
+	output_event_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (output_event_fd_ < 0)
+		throw std::runtime_error("MjpegEncoder: failed to create eventfd");
+	// Frames can complete out of order only by as many as there are encode threads, so this
+	// leaves room for the output thread to fall a few frames behind as well.
+	output_ring_.resize(2 * num_threads_ + 4);
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
-	LOG(2, "Opened MjpegEncoder");
+	for (unsigned int i = 0; i < num_threads_; i++)
+		encode_thread_.emplace_back(&MjpegEncoder::encodeThread, this);
+	LOG(2, "Opened MjpegEncoder with " << num_threads_ << " threads");
 }
 
 MjpegEncoder::~MjpegEncoder()
 {
-	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		abortEncode_ = true;
+		encode_cond_var_.notify_all();
+	}
+	for (auto &thread : encode_thread_)
+		thread.join();
 	abortOutput_ = true;
+	signalOutput();
 	output_thread_.join();
+	close(output_event_fd_);
 	LOG(2, "MjpegEncoder closed");
 }
 
-void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+								bool force_keyframe)
 {
-	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, info, timestamp_us, index_++ };
-	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
-}
+	JpegSliceLayout layout(info, 0, options_->mjpeg_slices);
+	auto frame = std::make_shared<EncodeFrame>(mem, info, timestamp_us, 0, layout);
+	frame->slices[0] = getBuffer();
+	for (unsigned int i = 1; i < layout.slices; i++)
+		frame->slices[i] = getSliceBuffer();
 
-void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
-{
-	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
-	cinfo.image_width = item.info.width;
-	cinfo.image_height = item.info.height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = 0;
-
-	jpeg_set_defaults(&cinfo);
-	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, options_->quality, TRUE);
-	encoded_buffer = nullptr;
-	buffer_len = 0;
-	jpeg_mem_len_t jpeg_mem_len;
-	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
-	jpeg_start_compress(&cinfo, TRUE);
-
-	int stride2 = item.info.stride / 2;
-	uint8_t *Y = (uint8_t *)item.mem;
-	uint8_t *U = (uint8_t *)Y + item.info.stride * item.info.height;
-	uint8_t *V = (uint8_t *)U + stride2 * (item.info.height / 2);
-	uint8_t *Y_max = U - item.info.stride;
-	uint8_t *U_max = V - stride2;
-	uint8_t *V_max = U_max + stride2 * (item.info.height / 2);
-
-	JSAMPROW y_rows[16];
-	JSAMPROW u_rows[8];
-	JSAMPROW v_rows[8];
-
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.info.height;)
-	{
-		for (int i = 0; i < 16; i++, Y_row += item.info.stride)
-			y_rows[i] = std::min(Y_row, Y_max);
-		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
-			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
-
-		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
-		jpeg_write_raw_data(&cinfo, rows, 16);
-	}
-
-	jpeg_finish_compress(&cinfo);
-	buffer_len = jpeg_mem_len;
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	frame->index = index_++;
+	for (unsigned int i = 0; i < layout.slices; i++)
+		encode_queue_.push({ frame, i });
+	if (layout.slices == 1)
+		encode_cond_var_.notify_one();
+	else
+		encode_cond_var_.notify_all();
 }
 
-void MjpegEncoder::encodeThread(int num)
+void MjpegEncoder::encodeThread()
 {
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
 	std::chrono::duration<double> encode_time(0);
-	uint32_t frames = 0;
+	uint32_t slices = 0;
+	// The libjpeg compressor lives as long as the thread, rather than being made for each slice.
+	JpegSliceCompressor compressor;
 
 	EncodeItem encode_item;
 	while (true)
 	{
 		{
 			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
+			encode_cond_var_.wait(lock, [this] { return abortEncode_ || !encode_queue_.empty(); });
+			if (encode_queue_.empty())
 			{
-				using namespace std::chrono_literals;
-				if (abortEncode_ && encode_queue_.empty())
-				{
-					if (frames)
-						LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames
-										 << "ms");
-					jpeg_destroy_compress(&cinfo);
-					return;
-				}
-				if (!encode_queue_.empty())
-				{
-					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
-				}
-				else
-					encode_cond_var_.wait_for(lock, 200ms);
+				if (slices)
+					LOG(2, "Encode " << slices << " slices, average time " << encode_time.count() * 1000 / slices
+									 << "ms");
+				return;
 			}
+			encode_item = std::move(encode_queue_.front());
+			encode_queue_.pop();
 		}
 
-		// Encode the buffer.
-		uint8_t *encoded_buffer = nullptr;
-		size_t buffer_len = 0;
+		// Encode the slice.
+		EncodeFrame &frame = *encode_item.frame;
+		unsigned int i = encode_item.slice;
 		auto start_time = std::chrono::high_resolution_clock::now();
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
+		frame.lens[i] = compressor.Encode((const uint8_t *)frame.mem, frame.info, frame.layout, i, options_->quality,
+										  frame.slices[i]);
 		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
-		frames++;
-		// Don't return buffers until the output thread as that's where they're
-		// in order again.
-
-		// We push this encoded buffer to another thread so that our
-		// application can take its time with the data without blocking the
-		// encode process.
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
-		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
-		output_cond_var_.notify_one();
+		slices++;
+
+		// Only the thread that finishes the last slice of the frame carries on.
+		if (frame.remaining.fetch_sub(1) != 1)
+		{
+			encode_item.frame.reset();
+			continue;
+		}
+
+		size_t buffer_len = JPEG_join_slices(frame.info, frame.layout, frame.slices[0], frame.slices, frame.lens);
+		for (unsigned int j = 1; j < frame.layout.slices; j++)
+			returnSliceBuffer(std::move(frame.slices[j]));
+
+		// The input buffer can go back straight away, rather than waiting for the output
+		// thread to get round to this frame, or for other threads to finish earlier frames.
+		input_done_callback_(frame.mem);
+
+		// We push this encoded buffer to another thread so that our application can take its
+		// time with the data without blocking the encode process. Each frame has its own slot
+		// in the ring, so if the output thread is so far behind that the slot is still in use,
+		// we must wait.
+		OutputItem output_item = { std::move(frame.slices[0]), buffer_len, frame.timestamp_us, frame.enqueue_time };
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			output_space_cond_var_.wait(lock, [this, &frame] {
+				return output_failed_ || frame.index < output_index_ + output_ring_.size();
+			});
+			if (!output_failed_)
+				output_ring_[frame.index % output_ring_.size()] = std::move(output_item);
+		}
+		signalOutput();
+		encode_item.frame.reset();
 	}
 }
 
+std::vector<uint8_t> MjpegEncoder::getBuffer()
+{
+	std::lock_guard<std::mutex> lock(pool_mutex_);
+	std::vector<uint8_t> buffer;
+	if (!buffer_pool_.empty())
+	{
+		buffer = std::move(buffer_pool_.back());
+		buffer_pool_.pop_back();
+	}
+	if (buffer.size() < expected_size_)
+		buffer.resize(expected_size_);
+	return buffer;
+}
+
+void MjpegEncoder::returnBuffer(std::vector<uint8_t> &&buffer, size_t bytes_used)
+{
+	std::lock_guard<std::mutex> lock(pool_mutex_);
+	// Follow increases in frame size immediately, with a little headroom, but let the
+	// estimate decay only slowly.
+	expected_size_ = std::max(bytes_used + bytes_used / 8, expected_size_ - expected_size_ / 16);
+	buffer_pool_.push_back(std::move(buffer));
+}
+
+std::vector<uint8_t> MjpegEncoder::getSliceBuffer()
+{
+	std::lock_guard<std::mutex> lock(pool_mutex_);
+	std::vector<uint8_t> buffer;
+	if (!slice_pool_.empty())
+	{
+		buffer = std::move(slice_pool_.back());
+		slice_pool_.pop_back();
+	}
+	return buffer;
+}
+
+void MjpegEncoder::returnSliceBuffer(std::vector<uint8_t> &&buffer)
+{
+	std::lock_guard<std::mutex> lock(pool_mutex_);
+	slice_pool_.push_back(std::move(buffer));
+}
+
+void MjpegEncoder::signalOutput()
+{
+	uint64_t one = 1;
+	if (write(output_event_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG_ERROR("MjpegEncoder: failed to signal output thread");
+}
+
 void MjpegEncoder::outputThread()
 {
-	OutputItem item;
-	uint64_t index = 0;
+	// Statistics on the time from a frame being submitted to its being output, so that any
+	// jitter introduced by the encoder can be seen.
+	double latency_sum = 0, latency_sum_sq = 0, latency_max = 0;
+	uint64_t frames = 0;
+
 	while (true)
 	{
+		// The eventfd counts the frames that have been added to the ring since we last looked
+		// (and also wakes us when it's time to stop), so we sleep until there is work to do.
+		uint64_t count;
+		if (read(output_event_fd_, &count, sizeof(count)) != sizeof(count))
 		{
-			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
+			if (errno == EINTR)
+				continue;
+			// An exception can't leave this thread, so stop delivering frames instead.
+			LOG_ERROR("MjpegEncoder: failed to read eventfd, no more frames will be output");
 			{
-				using namespace std::chrono_literals;
-				// We look for the thread that's completed the frame we want next.
-				// If we don't find it, we wait.
-				//
-				// Must also check for an abort signal, and if set, all queues must
-				// be empty. This is done first to ensure all frame callbacks have
-				// had a chance to run.
-				bool abort = abortOutput_ ? true : false;
-				for (auto &q : output_queue_)
-				{
-					if (abort && !q.empty())
-						abort = false;
-
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
-				}
-				if (abort)
-					return;
-
-				output_cond_var_.wait_for(lock, 200ms);
+				std::lock_guard<std::mutex> lock(output_mutex_);
+				output_failed_ = true;
 			}
+			output_space_cond_var_.notify_all();
+			break;
 		}
-	got_item:
-		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
-		index++;
+		// Deliver every frame that's now next in line.
+		while (true)
+		{
+			OutputItem item;
+			{
+				std::lock_guard<std::mutex> lock(output_mutex_);
+				auto &slot = output_ring_[output_index_ % output_ring_.size()];
+				if (!slot)
+					break;
+				item = std::move(*slot);
+				slot.reset();
+			}
+
+			output_ready_callback_(item.buffer.data(), item.bytes_used, item.timestamp_us, true);
+			returnBuffer(std::move(item.buffer), item.bytes_used);
+
+			std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - item.enqueue_time;
+			latency_sum += latency.count();
+			latency_sum_sq += latency.count() * latency.count();
+			latency_max = std::max(latency_max, latency.count());
+			frames++;
+
+			{
+				std::lock_guard<std::mutex> lock(output_mutex_);
+				output_index_++;
+			}
+			output_space_cond_var_.notify_all();
+		}
+
+		// The encode threads have all finished before we're told to stop, so everything has
+		// been output by now.
+		if (abortOutput_)
+			break;
+	}
+
+	if (frames)
+	{
+		double mean = latency_sum / frames;
+		double jitter = std::sqrt(std::max(latency_sum_sq / frames - mean * mean, 0.0));
+		LOG(2, "Output " << frames << " frames, latency mean " << mean << "ms, jitter (std dev) " << jitter
+						 << "ms, max " << latency_max << "ms");
 	}
 }
@@ -7,14 +7,19 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <thread>
+#include <vector>
 
-#include "encoder.hpp"
+#include "image/jpeg_slices.hpp"
 
-struct jpeg_compress_struct;
+#include "encoder.hpp"
 
 class MjpegEncoder : public Encoder
 {
@@ -22,46 +27,83 @@ public:
 	MjpegEncoder(VideoOptions const *options);
 	~MjpegEncoder();
 	// Encode the given buffer.
-	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+					  bool force_keyframe) override;
 
 private:
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 4;
-
-	// These threads do the actual encoding.
-	void encodeThread(int num);
+	// These threads do the actual encoding. Each frame is divided into slices, and whichever
+	// thread is idle will pick up the next slice. The thread that finishes the last slice of a
+	// frame joins them all together.
+	void encodeThread();
 
 	// Handle the output buffers in another thread so as not to block the encoders. The
 	// application can take its time, after which we return this buffer to the encoder for
 	// re-use.
 	void outputThread();
+	void signalOutput();
 
 	bool abortEncode_;
-	bool abortOutput_;
+	std::atomic<bool> abortOutput_;
 	uint64_t index_;
+	unsigned int num_threads_;
 
-	struct EncodeItem
+	struct EncodeFrame
 	{
+		EncodeFrame(void *m, StreamInfo const &i, int64_t t, uint64_t n, JpegSliceLayout const &l)
+			: mem(m), info(i), timestamp_us(t), index(n), enqueue_time(std::chrono::steady_clock::now()), layout(l),
+			  slices(l.slices), lens(l.slices), remaining(l.slices)
+		{
+		}
 		void *mem;
 		StreamInfo info;
 		int64_t timestamp_us;
 		uint64_t index;
+		std::chrono::steady_clock::time_point enqueue_time;
+		JpegSliceLayout layout;
+		// Each slice is encoded into its own buffer. slices[0] is the output buffer, in which
+		// the whole JPEG is finally assembled.
+		std::vector<std::vector<uint8_t>> slices;
+		std::vector<size_t> lens;
+		std::atomic<unsigned int> remaining;
+	};
+	struct EncodeItem
+	{
+		std::shared_ptr<EncodeFrame> frame;
+		unsigned int slice;
 	};
 	std::queue<EncodeItem> encode_queue_;
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	std::vector<std::thread> encode_thread_;
+
+	// Pool of buffers for the encoded frames, so that we aren't forever allocating and freeing
+	// them. New buffers are allocated at a size that should fit recent frames.
+	std::vector<uint8_t> getBuffer();
+	void returnBuffer(std::vector<uint8_t> &&buffer, size_t bytes_used);
+	std::vector<uint8_t> getSliceBuffer();
+	void returnSliceBuffer(std::vector<uint8_t> &&buffer);
+	std::mutex pool_mutex_;
+	std::vector<std::vector<uint8_t>> buffer_pool_;
+	size_t expected_size_;
+	// The buffers for slices other than the first are kept for re-use in the same way.
+	std::vector<std::vector<uint8_t>> slice_pool_;
 
 	struct OutputItem
 	{
-		void *mem;
+		std::vector<uint8_t> buffer;
 		size_t bytes_used;
 		int64_t timestamp_us;
-		uint64_t index;
+		std::chrono::steady_clock::time_point enqueue_time;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
+	// Encoded frames wait in a ring, in the slot given by their index, until the output thread
+	// reaches them. The output thread sleeps on the eventfd, which is signalled whenever a
+	// frame is added, or when it's time to stop. If the output thread fails, the encode
+	// threads discard their frames rather than waiting for it.
+	std::vector<std::optional<OutputItem>> output_ring_;
+	uint64_t output_index_;
+	bool output_failed_;
 	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
+	std::condition_variable output_space_cond_var_;
+	int output_event_fd_;
 	std::thread output_thread_;
 };
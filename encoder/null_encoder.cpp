@@ -25,7 +25,8 @@ NullEncoder::~NullEncoder()
 }
 
 // Push the buffer onto the output queue to be "encoded" and returned.
-void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us,
+							   bool force_keyframe)
 {
 	std::lock_guard<std::mutex> lock(output_mutex_);
 	OutputItem item = { mem, size, timestamp_us };
@@ -60,7 +61,7 @@ void NullEncoder::outputThread()
 		// Ensure the input done callback happens before the output ready callback.
 		// This is needed as the metadata queue gets pushed in the former, and popped
 		// in the latter.
-		input_done_callback_(nullptr);
+		input_done_callback_(item.mem);
 		output_ready_callback_(item.mem, item.length, item.timestamp_us, true);
 	}
 }
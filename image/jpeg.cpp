@@ -23,6 +23,8 @@
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "image/jpeg_slices.hpp"
+
 #ifndef MAKE_STRING
 #define MAKE_STRING "Raspberry Pi"
 #endif
@@ -595,8 +597,20 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 		// YUV422 or YUV420 planar format).
 
 		jpeg_mem_len_t jpeg_len;
-		YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->quality, options->restart,
-					jpeg_buffer, jpeg_len);
+		std::vector<uint8_t> sliced_jpeg;
+		const uint8_t *jpeg_data;
+		if (info.pixel_format == libcamera::formats::YUV420 && options->jpeg_slices != 1)
+		{
+			jpeg_len = YUV420_to_JPEG_slices((uint8_t *)(mem[0].data()), info, options->quality, options->restart,
+											 options->jpeg_slices, sliced_jpeg);
+			jpeg_data = sliced_jpeg.data();
+		}
+		else
+		{
+			YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->quality, options->restart,
+						jpeg_buffer, jpeg_len);
+			jpeg_data = jpeg_buffer;
+		}
 		LOG(2, "JPEG size is " << jpeg_len);
 
 		// Write everything out.
@@ -610,7 +624,7 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 		if (fwrite(exif_header, sizeof(exif_header), 1, fp) != 1 || fputc((exif_len + thumb_len + 2) >> 8, fp) == EOF ||
 			fputc((exif_len + thumb_len + 2) & 0xff, fp) == EOF || fwrite(exif_buffer, exif_len, 1, fp) != 1 ||
 			(thumb_len && fwrite(thumb_buffer, thumb_len, 1, fp) != 1) ||
-			fwrite(jpeg_buffer + exif_image_offset, jpeg_len - exif_image_offset, 1, fp) != 1)
+			fwrite(jpeg_data + exif_image_offset, jpeg_len - exif_image_offset, 1, fp) != 1)
 			throw std::runtime_error("failed to write file - output probably corrupt");
 
 		if (fp != stdout)
@@ -0,0 +1,270 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * jpeg_slices.cpp - encode a JPEG as horizontal slices in parallel
+ */
+
+#include <cstdio>
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+#include <jpeglib.h>
+
+#include "core/logging.hpp"
+#include "image/jpeg_slices.hpp"
+
+// Each slice is encoded as a complete JPEG of its own, using the same (default) tables and
+// with restart markers enabled. Restart markers reset the entropy coder's state, so the
+// coded data between them is self-contained. That means we can take the headers from the
+// first slice, fix the image height in them, and follow them with the entropy-coded data of
+// every slice in turn. We need only put a restart marker between consecutive slices, and
+// renumber all the markers, which must run RST0 to RST7 cyclically through the image.
+
+namespace {
+
+// A libjpeg destination manager that writes into a std::vector, growing it if the image
+// turns out not to fit.
+struct VectorDestination
+{
+	jpeg_destination_mgr pub;
+	std::vector<uint8_t> *buffer;
+};
+
+void init_destination(j_compress_ptr cinfo)
+{
+	VectorDestination *dest = (VectorDestination *)cinfo->dest;
+	dest->pub.next_output_byte = dest->buffer->data();
+	dest->pub.free_in_buffer = dest->buffer->size();
+}
+
+boolean empty_output_buffer(j_compress_ptr cinfo)
+{
+	VectorDestination *dest = (VectorDestination *)cinfo->dest;
+	size_t used = dest->buffer->size();
+	dest->buffer->resize(used * 3 / 2);
+	dest->pub.next_output_byte = dest->buffer->data() + used;
+	dest->pub.free_in_buffer = dest->buffer->size() - used;
+	return TRUE;
+}
+
+void term_destination(j_compress_ptr cinfo)
+{
+}
+
+// Encode rows y0 to y1 of the image as a JPEG in its own right.
+size_t encode_band(jpeg_compress_struct &cinfo, const uint8_t *input, StreamInfo const &info, unsigned int y0,
+				   unsigned int y1, int quality, unsigned int restart, std::vector<uint8_t> &jpeg)
+{
+	cinfo.image_width = info.width;
+	cinfo.image_height = y1 - y0;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_YCbCr;
+
+	jpeg_set_defaults(&cinfo);
+	cinfo.raw_data_in = TRUE;
+	cinfo.restart_interval = restart;
+	jpeg_set_quality(&cinfo, quality, TRUE);
+
+	// Until we've seen some frames, guess that they'll be no bigger than this.
+	if (jpeg.empty())
+		jpeg.resize(std::max(info.width * (y1 - y0) / 4, 4096u));
+	VectorDestination dest;
+	dest.pub.init_destination = init_destination;
+	dest.pub.empty_output_buffer = empty_output_buffer;
+	dest.pub.term_destination = term_destination;
+	dest.buffer = &jpeg;
+	cinfo.dest = &dest.pub;
+	jpeg_start_compress(&cinfo, TRUE);
+
+	// The same as YUV420_to_JPEG_fast in jpeg.cpp, but starting at row y0.
+	unsigned int stride2 = info.stride / 2;
+	const uint8_t *Y = input + y0 * info.stride;
+	const uint8_t *U = input + info.stride * info.height + (y0 / 2) * stride2;
+	const uint8_t *V = U + stride2 * (info.height / 2);
+	const uint8_t *Y_max = Y + (y1 - y0 - 1) * info.stride;
+	const uint8_t *U_max = U + ((y1 - y0 + 1) / 2 - 1) * stride2;
+	const uint8_t *V_max = V + ((y1 - y0 + 1) / 2 - 1) * stride2;
+
+	JSAMPROW y_rows[16];
+	JSAMPROW u_rows[8];
+	JSAMPROW v_rows[8];
+
+	for (const uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < cinfo.image_height;)
+	{
+		for (int i = 0; i < 16; i++, Y_row += info.stride)
+			y_rows[i] = (JSAMPROW)std::min(Y_row, Y_max);
+		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
+			u_rows[i] = (JSAMPROW)std::min(U_row, U_max), v_rows[i] = (JSAMPROW)std::min(V_row, V_max);
+
+		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
+		jpeg_write_raw_data(&cinfo, rows, 16);
+	}
+
+	// Finishing leaves the compressor ready to be used again for the next band.
+	jpeg_finish_compress(&cinfo);
+	cinfo.dest = nullptr;
+	return jpeg.size() - dest.pub.free_in_buffer;
+}
+
+// Return the offset of the entropy-coded data, which follows the SOS header, and optionally
+// the offset of the image height in the SOF header.
+size_t find_entropy_data(const uint8_t *jpeg, size_t len, size_t *height_offset = nullptr)
+{
+	size_t pos = 2; // skip SOI
+	while (pos + 4 <= len)
+	{
+		if (jpeg[pos] != 0xff)
+			throw std::runtime_error("JPEG slices: bad marker in header");
+		uint8_t marker = jpeg[pos + 1];
+		size_t segment_len = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+		if (marker == 0xc0 && height_offset)
+			*height_offset = pos + 5;
+		pos += 2 + segment_len;
+		if (marker == 0xda)
+			return pos;
+	}
+	throw std::runtime_error("JPEG slices: no SOS marker found");
+}
+
+// Renumber the restart markers in some entropy-coded data, continuing from the given count.
+void renumber_restarts(uint8_t *data, size_t len, unsigned int &count)
+{
+	for (size_t i = 0; i + 1 < len; i++)
+	{
+		// A 0xff in the data is always followed either by a zero (byte stuffing) or a marker,
+		// so we can skip the byte after it either way.
+		if (data[i] == 0xff)
+		{
+			if (data[i + 1] >= 0xd0 && data[i + 1] <= 0xd7)
+				data[i + 1] = 0xd0 + (count++ & 7);
+			i++;
+		}
+	}
+}
+
+} // namespace
+
+JpegSliceLayout::JpegSliceLayout(StreamInfo const &info, unsigned int restart_interval, unsigned int num_slices)
+	: height(info.height)
+{
+	unsigned int mcus_per_row = (info.width + 15) / 16;
+	unsigned int mcu_rows = (info.height + 15) / 16;
+
+	// The slices must end where restart intervals do, so work out how many MCU rows there are
+	// in a "unit" that we can put a slice boundary after.
+	unsigned int interval = mcus_per_row;
+	unit_rows = 1;
+	if (restart_interval)
+	{
+		if (mcus_per_row % restart_interval == 0)
+			interval = restart_interval;
+		else if (restart_interval % mcus_per_row == 0)
+			interval = restart_interval, unit_rows = restart_interval / mcus_per_row;
+		else if (num_slices != 1)
+			LOG(2, "JPEG slices: restart interval " << restart_interval << " changed to " << interval);
+	}
+	units = (mcu_rows + unit_rows - 1) / unit_rows;
+
+	if (!num_slices)
+		num_slices = std::thread::hardware_concurrency();
+	slices = std::clamp(num_slices, 1u, units);
+	// A single slice is just an ordinary JPEG, which can have whatever restart interval it likes.
+	restart = slices == 1 ? restart_interval : interval;
+}
+
+unsigned int JpegSliceLayout::Y0(unsigned int i) const
+{
+	return i * units / slices * unit_rows * 16;
+}
+
+unsigned int JpegSliceLayout::Y1(unsigned int i) const
+{
+	return std::min((i + 1) * units / slices * unit_rows * 16, height);
+}
+
+struct JpegSliceCompressor::Compressor
+{
+	jpeg_compress_struct cinfo;
+	jpeg_error_mgr jerr;
+};
+
+JpegSliceCompressor::JpegSliceCompressor() : compressor_(std::make_unique<Compressor>())
+{
+	compressor_->cinfo.err = jpeg_std_error(&compressor_->jerr);
+	jpeg_create_compress(&compressor_->cinfo);
+}
+
+JpegSliceCompressor::~JpegSliceCompressor()
+{
+	jpeg_destroy_compress(&compressor_->cinfo);
+}
+
+size_t JpegSliceCompressor::Encode(const uint8_t *input, StreamInfo const &info, JpegSliceLayout const &layout,
+								   unsigned int i, int quality, std::vector<uint8_t> &jpeg)
+{
+	return encode_band(compressor_->cinfo, input, info, layout.Y0(i), layout.Y1(i), quality, layout.restart, jpeg);
+}
+
+size_t JPEG_join_slices(StreamInfo const &info, JpegSliceLayout const &layout, std::vector<uint8_t> &jpeg,
+						std::vector<std::vector<uint8_t>> const &slices, std::vector<size_t> const &lens)
+{
+	if (layout.slices == 1)
+		return lens[0];
+
+	// Keep the first slice's headers and data (but not its EOI), and correct the height.
+	size_t height_offset = 0;
+	find_entropy_data(jpeg.data(), lens[0], &height_offset);
+	if (!height_offset)
+		throw std::runtime_error("JPEG slices: no SOF0 marker found");
+	jpeg[height_offset] = info.height >> 8;
+	jpeg[height_offset + 1] = info.height & 0xff;
+	unsigned int restart_count = 0;
+	size_t entropy_start = find_entropy_data(jpeg.data(), lens[0]);
+	renumber_restarts(jpeg.data() + entropy_start, lens[0] - 2 - entropy_start, restart_count);
+	size_t len = lens[0] - 2;
+
+	for (unsigned int i = 1; i < layout.slices; i++)
+	{
+		const uint8_t *band = slices[i].data();
+		size_t start = find_entropy_data(band, lens[i]);
+		size_t entropy_len = lens[i] - 2 - start;
+		if (jpeg.size() < len + 2 + entropy_len + 2)
+			jpeg.resize((len + 2 + entropy_len + 2) * 5 / 4);
+		jpeg[len++] = 0xff;
+		jpeg[len++] = 0xd0 + (restart_count++ & 7);
+		std::copy_n(band + start, entropy_len, jpeg.data() + len);
+		renumber_restarts(jpeg.data() + len, entropy_len, restart_count);
+		len += entropy_len;
+	}
+
+	jpeg[len++] = 0xff;
+	jpeg[len++] = 0xd9;
+	return len;
+}
+
+// This one-shot version is for stills, where there's only one image to encode, so it simply
+// makes a thread and a compressor for each slice.
+size_t YUV420_to_JPEG_slices(const uint8_t *input, StreamInfo const &info, int quality, unsigned int restart,
+							 unsigned int slices, std::vector<uint8_t> &jpeg)
+{
+	JpegSliceLayout layout(info, restart, slices);
+
+	// The first slice goes straight into the output, the others into their own buffers.
+	std::vector<std::vector<uint8_t>> band_buffers(layout.slices);
+	std::vector<size_t> band_lens(layout.slices);
+	auto encode = [&](unsigned int i) {
+		JpegSliceCompressor compressor;
+		band_lens[i] = compressor.Encode(input, info, layout, i, quality, i ? band_buffers[i] : jpeg);
+	};
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < layout.slices; i++)
+		threads.emplace_back(encode, i);
+	encode(0);
+	for (auto &t : threads)
+		t.join();
+
+	return JPEG_join_slices(info, layout, jpeg, band_buffers, band_lens);
+}
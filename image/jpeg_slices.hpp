@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * jpeg_slices.hpp - encode a JPEG as horizontal slices in parallel
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "core/stream_info.hpp"
+
+// Encode a YUV420 image as a baseline JPEG. The image is divided into horizontal slices
+// (a whole number of 16-line MCU rows each) which are encoded in parallel, and the results
+// stitched together into a single JPEG using restart markers at the slice boundaries. With
+// one slice this is just an ordinary encode, and 0 means one slice per CPU core.
+//
+// A non-zero restart interval (in MCUs) is honoured if it fits the slice boundaries,
+// otherwise we restart at the end of every MCU row.
+//
+// The JPEG is written to the start of the jpeg vector, which grows as needed but is never
+// shrunk (so that buffers can be re-used), and the number of bytes written is returned.
+size_t YUV420_to_JPEG_slices(const uint8_t *input, StreamInfo const &info, int quality, unsigned int restart,
+							 unsigned int slices, std::vector<uint8_t> &jpeg);
+
+// The pieces of the above, for callers such as the MJPEG encoder that want to encode the
+// slices of a stream of frames on threads of their own, re-using everything across frames.
+
+// How an image is divided into slices, and the restart interval each slice must be encoded
+// with.
+struct JpegSliceLayout
+{
+	JpegSliceLayout(StreamInfo const &info, unsigned int restart, unsigned int slices);
+	// The first row of slice i, and the row after its last.
+	unsigned int Y0(unsigned int i) const;
+	unsigned int Y1(unsigned int i) const;
+
+	unsigned int slices;
+	unsigned int restart;
+	unsigned int unit_rows;
+	unsigned int units;
+	unsigned int height;
+};
+
+// A libjpeg compressor that is created once and then re-used for every slice it encodes. Each
+// one may be used by only one thread at a time.
+class JpegSliceCompressor
+{
+public:
+	JpegSliceCompressor();
+	~JpegSliceCompressor();
+	// Encode slice i of the image into the start of jpeg (as above, it grows as needed) and
+	// return the number of bytes written.
+	size_t Encode(const uint8_t *input, StreamInfo const &info, JpegSliceLayout const &layout, unsigned int i,
+				  int quality, std::vector<uint8_t> &jpeg);
+
+private:
+	struct Compressor;
+	std::unique_ptr<Compressor> compressor_;
+};
+
+// Join encoded slices into one JPEG. The first slice (of length lens[0]) is already at the
+// start of jpeg, and slice i > 0 is in slices[i]. Returns the length of the whole JPEG.
+size_t JPEG_join_slices(StreamInfo const &info, JpegSliceLayout const &layout, std::vector<uint8_t> &jpeg,
+						std::vector<std::vector<uint8_t>> const &slices, std::vector<size_t> const &lens);
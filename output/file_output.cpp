@@ -5,24 +5,86 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+
 #include "file_output.hpp"
 
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), count_(0), file_start_time_ms_(0), file_open_(false), chunk_(nullptr),
+	  chunk_used_(0), pipe_(false), abort_(false), stalls_(0), stall_max_(0), slow_writes_(0), slow_write_max_(0),
+	  bytes_in_flight_(0), bytes_in_flight_max_(0), bytes_written_(0), busy_time_(0)
 {
+	if (options->output_buffer)
+	{
+		unsigned int num_chunks = std::max<size_t>(options->output_buffer * 1024 * 1024 / CHUNK_SIZE, 2);
+		for (unsigned int i = 0; i < num_chunks; i++)
+		{
+			// Page aligned, in case the file was opened for direct I/O.
+			uint8_t *chunk = static_cast<uint8_t *>(aligned_alloc(4096, CHUNK_SIZE));
+			if (!chunk)
+				throw std::runtime_error("FileOutput: failed to allocate staging buffer");
+			chunks_.push_back(chunk);
+		}
+		free_chunks_ = chunks_;
+		writer_.reset(FileWriter::Create(options, chunks_, CHUNK_SIZE,
+										 [this](uint8_t const *data, size_t size, auto duration) {
+											 writeDone(data, size, duration);
+										 }));
+		writer_thread_ = std::thread(&FileOutput::writerThread, this);
+	}
+	else
+		writer_.reset(FileWriter::Create(options, {}, 0, nullptr));
 }
 
 FileOutput::~FileOutput()
 {
 	closeFile();
+
+	if (writer_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		job_cond_var_.notify_one();
+		writer_thread_.join();
+		if (writer_error_)
+			LOG_ERROR("FileOutput: output file was not written correctly");
+
+		LOG(2, "FileOutput: most data waiting to be written was " << bytes_in_flight_max_ / 1024 << "kB, "
+																   << slow_writes_ << " slow writes (longest "
+																   << slow_write_max_.count() << "ms)");
+		if (busy_time_.count() > 0)
+			LOG(2, "FileOutput: wrote " << bytes_written_ / (1024 * 1024) << "MB using " << writer_->Name() << " at "
+										<< bytes_written_ / busy_time_.count() / (1024 * 1024) << "MB/s");
+		if (stalls_)
+			LOG(1, "FileOutput: had to wait for storage " << stalls_ << " times (longest " << stall_max_.count()
+														  << "ms), consider a larger --output-buffer");
+	}
+
+	writer_.reset();
+	for (uint8_t *chunk : chunks_)
+		free(chunk);
 }
 
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (writer_error_)
+			std::rethrow_exception(writer_error_);
+	}
+
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	if (!file_open_ ||
 		(options_->segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->segment) ||
 		(options_->split && (flags & FLAG_RESTART)))
@@ -32,19 +94,24 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 	}
 
 	LOG(2, "FileOutput: output buffer " << mem << " size " << size);
-	if (fp_ && size)
-	{
-		if (fwrite(mem, size, 1, fp_) != 1)
-			throw std::runtime_error("failed to write output bytes");
-		if (options_->flush)
-			fflush(fp_);
-	}
+	if (file_open_ && size)
+		write(mem, size);
+}
+
+// Pipes, sockets and the like have someone reading from them as we go.
+static bool is_pipe(struct stat const &st)
+{
+	return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode);
 }
 
 void FileOutput::openFile(int64_t timestamp_us)
 {
+	struct stat st;
 	if (options_->output == "-")
-		fp_ = stdout;
+	{
+		pipe_ = fstat(STDOUT_FILENO, &st) == 0 && is_pipe(st);
+		submit({ Job::Open, nullptr, 0, "-" });
+	}
 	else if (!options_->output.empty())
 	{
 		// Generate the next output file name.
@@ -56,23 +123,216 @@ void FileOutput::openFile(int64_t timestamp_us)
 		if (n < 0)
 			throw std::runtime_error("failed to generate filename");
 
-		fp_ = fopen(filename, "w");
-		if (!fp_)
-			throw std::runtime_error("failed to open output file " + std::string(filename));
-		LOG(2, "FileOutput: opened output file " << filename);
-
+		pipe_ = stat(filename, &st) == 0 && is_pipe(st);
+		submit({ Job::Open, nullptr, 0, filename });
 		file_start_time_ms_ = timestamp_us / 1000;
 	}
+	else
+		return;
+
+	file_open_ = true;
 }
 
 void FileOutput::closeFile()
 {
-	if (fp_)
+	if (file_open_)
+	{
+		{
+			std::lock_guard<std::mutex> lock(chunk_mutex_);
+			if (chunk_used_)
+				submitChunk();
+		}
+		submit({ Job::Close, nullptr, 0, {} });
+		file_open_ = false;
+	}
+}
+
+void FileOutput::write(void const *mem, size_t size)
+{
+	if (!writer_thread_.joinable())
+	{
+		submit({ Job::Write, static_cast<uint8_t const *>(mem), size, {} });
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(chunk_mutex_);
+	uint8_t const *data = static_cast<uint8_t const *>(mem);
+	while (size)
+	{
+		if (!chunk_)
+			chunk_ = getChunk();
+		size_t n = std::min(size, CHUNK_SIZE - chunk_used_);
+		memcpy(chunk_ + chunk_used_, data, n);
+		chunk_used_ += n;
+		data += n;
+		size -= n;
+		if (chunk_used_ == CHUNK_SIZE)
+			submitChunk();
+	}
+
+	// Don't let small amounts of data sit here for long, and not at all if someone is
+	// waiting for it at the other end of a pipe. Direct I/O can't write partial pages, so
+	// then we wait for the chunk to fill.
+	if (chunk_used_ && !writer_->Direct() &&
+		(options_->flush || pipe_ || std::chrono::steady_clock::now() - chunk_start_ > MAX_CHUNK_DELAY))
+		submitChunk();
+}
+
+void FileOutput::flushAgedChunk()
+{
+	// If the output thread has the chunk it must be adding a frame to it (or waiting for
+	// space, which only we can make), and it will check the chunk's age itself.
+	std::unique_lock<std::mutex> lock(chunk_mutex_, std::try_to_lock);
+	if (lock && chunk_used_ && !writer_->Direct() &&
+		std::chrono::steady_clock::now() - chunk_start_ > MAX_CHUNK_DELAY)
+	{
+		LOG(2, "FileOutput: sending partly filled chunk of " << chunk_used_ << " bytes");
+		submitChunk();
+	}
+}
+
+uint8_t *FileOutput::getChunk()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	if (free_chunks_.empty())
+	{
+		// The staging buffer is full, so the storage must have stalled. All we can do is
+		// wait, which will hold up the encoder.
+		auto start = std::chrono::steady_clock::now();
+		free_cond_var_.wait(lock, [this] { return !free_chunks_.empty(); });
+		std::chrono::duration<double, std::milli> stall = std::chrono::steady_clock::now() - start;
+		LOG(2, "FileOutput: waited " << stall.count() << "ms for storage");
+		stalls_++;
+		stall_max_ = std::max(stall_max_, stall);
+	}
+	uint8_t *chunk = free_chunks_.back();
+	free_chunks_.pop_back();
+	chunk_start_ = std::chrono::steady_clock::now();
+	return chunk;
+}
+
+void FileOutput::submitChunk()
+{
+	submit({ Job::Write, chunk_, chunk_used_, {} });
+	chunk_ = nullptr;
+	chunk_used_ = 0;
+}
+
+void FileOutput::submit(Job &&job)
+{
+	if (!writer_thread_.joinable())
+	{
+		runJob(job);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (job.type == Job::Write)
+		{
+			if (!bytes_in_flight_)
+				busy_start_ = std::chrono::steady_clock::now();
+			bytes_in_flight_ += job.size;
+			bytes_in_flight_max_ = std::max(bytes_in_flight_max_, bytes_in_flight_);
+		}
+		jobs_.push(std::move(job));
+	}
+	job_cond_var_.notify_one();
+	writer_->Wake();
+}
+
+void FileOutput::runJob(Job const &job)
+{
+	switch (job.type)
+	{
+	case Job::Open:
+		writer_->Open(job.filename);
+		break;
+
+	case Job::Write:
+		writer_->Write(job.data, job.size);
+		break;
+
+	case Job::Close:
+		writer_->Close();
+		break;
+	}
+}
+
+void FileOutput::writerThread()
+{
+	while (true)
+	{
+		Job job;
+		bool have_job = false, idle = false;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			// While writes are in progress, we wait in the writer instead, which returns when
+			// any of them finishes or when a new job arrives. Otherwise we wake up now and then
+			// to send on a partly filled chunk if frames have stopped arriving.
+			if (!jobs_.empty() || !writer_->Busy())
+			{
+				idle = !job_cond_var_.wait_for(lock, MAX_CHUNK_DELAY, [this] { return abort_ || !jobs_.empty(); });
+				// We're only told to stop after the last file is closed, so there's nothing
+				// more to write once the queue is empty.
+				if (!idle && jobs_.empty())
+					break;
+				if (!idle)
+				{
+					job = std::move(jobs_.front());
+					jobs_.pop();
+					have_job = true;
+				}
+			}
+		}
+
+		if (idle)
+		{
+			flushAgedChunk();
+			continue;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		try
+		{
+			if (have_job)
+				runJob(job);
+			else
+				writer_->Wait();
+		}
+		catch (std::exception const &e)
+		{
+			// Give up on the file, but keep recycling the chunks. The error is passed back
+			// to the application when it next gives us a frame.
+			LOG_ERROR("FileOutput: " << e.what());
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!writer_error_)
+				writer_error_ = std::current_exception();
+		}
+		std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+
+		// Writes are timed by the writer, as they may finish later.
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (have_job && job.type != Job::Write && duration > SLOW_WRITE)
+		{
+			slow_writes_++;
+			slow_write_max_ = std::max(slow_write_max_, duration);
+		}
+	}
+}
+
+void FileOutput::writeDone(uint8_t const *data, size_t size, std::chrono::duration<double, std::milli> duration)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (duration > SLOW_WRITE)
 	{
-		if (options_->flush)
-			fflush(fp_);
-		if (fp_ != stdout)
-			fclose(fp_);
-		fp_ = nullptr;
+		slow_writes_++;
+		slow_write_max_ = std::max(slow_write_max_, duration);
 	}
+	free_chunks_.push_back(const_cast<uint8_t *>(data));
+	bytes_in_flight_ -= size;
+	bytes_written_ += size;
+	if (!bytes_in_flight_)
+		busy_time_ += std::chrono::steady_clock::now() - busy_start_;
+	free_cond_var_.notify_one();
 }
@@ -7,6 +7,17 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "file_writer.hpp"
 #include "output.hpp"
 
 class FileOutput : public Output
@@ -21,7 +32,73 @@ protected:
 private:
 	void openFile(int64_t timestamp_us);
 	void closeFile();
-	FILE *fp_;
+	void write(void const *mem, size_t size);
+	std::unique_ptr<FileWriter> writer_;
 	unsigned int count_;
 	int64_t file_start_time_ms_;
+	bool file_open_;
+
+	// Everything that touches the file is a job. Normally we copy the data into a staging
+	// buffer, made of fixed-size chunks, and a separate thread does the jobs, so that storage
+	// stalls don't hold up the encoder until the whole staging buffer is full. Without a
+	// staging buffer, the jobs are done straight away. The writer may finish the writes
+	// later still, and hands back each chunk once its data is safely with the kernel.
+	struct Job
+	{
+		enum Type
+		{
+			Write,
+			Open,
+			Close
+		} type;
+		uint8_t const *data;
+		size_t size;
+		std::string filename;
+	};
+	void submit(Job &&job);
+	void runJob(Job const &job);
+	void writerThread();
+	void writeDone(uint8_t const *data, size_t size, std::chrono::duration<double, std::milli> duration);
+
+	// Frames are packed into chunks, which go to the writer when full, so that writes are
+	// large and aligned. A partly filled chunk is sent anyway if it has been waiting too long
+	// (the writer thread checks for this even when no frames are arriving), and straight away
+	// if the output is a pipe, where someone may be waiting for every frame.
+	static constexpr size_t CHUNK_SIZE = 512 * 1024;
+	static constexpr std::chrono::milliseconds MAX_CHUNK_DELAY { 100 };
+	// Jobs taking longer than this count as storage stalls.
+	static constexpr std::chrono::milliseconds SLOW_WRITE { 100 };
+	uint8_t *getChunk();
+	void submitChunk();
+	void flushAgedChunk();
+	std::vector<uint8_t *> chunks_;
+	std::vector<uint8_t *> free_chunks_;
+	// Protects the chunk being filled, which the writer thread may send on.
+	std::mutex chunk_mutex_;
+	uint8_t *chunk_;
+	size_t chunk_used_;
+	std::chrono::steady_clock::time_point chunk_start_;
+	bool pipe_;
+
+	std::mutex mutex_;
+	std::condition_variable job_cond_var_;
+	std::condition_variable free_cond_var_;
+	std::queue<Job> jobs_;
+	bool abort_;
+	std::exception_ptr writer_error_;
+	std::thread writer_thread_;
+
+	// Statistics: how often (and for how long) the encoder had to wait for space, how often
+	// the storage was slow, and the most data we've had waiting to be written. The
+	// throughput is measured over the time there was data waiting, so that it reflects the
+	// storage rather than how fast the encoder produces data.
+	unsigned int stalls_;
+	std::chrono::duration<double, std::milli> stall_max_;
+	unsigned int slow_writes_;
+	std::chrono::duration<double, std::milli> slow_write_max_;
+	size_t bytes_in_flight_;
+	size_t bytes_in_flight_max_;
+	uint64_t bytes_written_;
+	std::chrono::steady_clock::time_point busy_start_;
+	std::chrono::duration<double> busy_time_;
 };
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * file_writer.cpp - write data to files for FileOutput.
+ */
+
+#include <stdexcept>
+
+#include "file_writer.hpp"
+
+#if LIBURING_PRESENT
+#include "uring_writer.hpp"
+#endif
+
+FileWriter *FileWriter::Create(VideoOptions const *options, std::vector<uint8_t *> const &chunks, size_t chunk_size,
+							   DoneCallback const &done)
+{
+	if (options->output_backend == "io_uring" && !chunks.empty() && options->output != "-")
+	{
+#if LIBURING_PRESENT
+		try
+		{
+			return new UringWriter(options, chunks, chunk_size, done);
+		}
+		catch (std::exception const &e)
+		{
+			LOG(1, "FileOutput: " << e.what() << ", using stdio instead");
+		}
+#else
+		LOG(1, "FileOutput: io_uring not available in this build, using stdio instead");
+#endif
+	}
+
+	return new StdioWriter(options, done, !chunks.empty());
+}
+
+StdioWriter::StdioWriter(VideoOptions const *options, DoneCallback const &done, bool staged)
+	: FileWriter(options, done), fp_(nullptr), staged_(staged)
+{
+}
+
+StdioWriter::~StdioWriter()
+{
+	Close();
+}
+
+void StdioWriter::Open(std::string const &filename)
+{
+	if (filename == "-")
+		fp_ = stdout;
+	else
+	{
+		fp_ = fopen(filename.c_str(), "w");
+		if (!fp_)
+			throw std::runtime_error("failed to open output file " + filename);
+		LOG(2, "FileOutput: opened output file " << filename);
+	}
+}
+
+void StdioWriter::Write(uint8_t const *data, size_t size)
+{
+	if (!fp_)
+	{
+		done(data, size, std::chrono::duration<double, std::milli>(0));
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	bool ok = fwrite(data, size, 1, fp_) == 1;
+	if (ok && (options_->flush || staged_))
+		ok = fflush(fp_) == 0;
+	done(data, size, std::chrono::steady_clock::now() - start);
+	if (!ok)
+		throw std::runtime_error("failed to write output bytes");
+}
+
+void StdioWriter::Close()
+{
+	if (fp_)
+	{
+		if (options_->flush)
+			fflush(fp_);
+		if (fp_ != stdout)
+			fclose(fp_);
+		fp_ = nullptr;
+	}
+}
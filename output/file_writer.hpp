@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * file_writer.hpp - write data to files for FileOutput.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "core/video_options.hpp"
+
+// A FileWriter does the actual file operations for FileOutput, always from the same thread.
+// Writes may finish later, and in any order, after which the writer calls the done callback,
+// from inside either Write or Wait. Asynchronous writers only accept data that lies in the
+// chunks that they are given when they are made.
+class FileWriter
+{
+public:
+	typedef std::function<void(uint8_t const *data, size_t size, std::chrono::duration<double, std::milli> duration)>
+		DoneCallback;
+
+	// Make the writer that the options ask for, or a stdio one if that isn't possible.
+	static FileWriter *Create(VideoOptions const *options, std::vector<uint8_t *> const &chunks, size_t chunk_size,
+							  DoneCallback const &done);
+
+	FileWriter(VideoOptions const *options, DoneCallback const &done) : options_(options), done_(done) {}
+	virtual ~FileWriter() {}
+	virtual char const *Name() const = 0;
+	virtual void Open(std::string const &filename) = 0;
+	virtual void Write(uint8_t const *data, size_t size) = 0;
+	// Close the file, once any writes to it have finished.
+	virtual void Close() = 0;
+	// Whether any writes are still in progress.
+	virtual bool Busy() const { return false; }
+	// Wait until at least one write has finished, or Wake is called.
+	virtual void Wait() {}
+	// Interrupt a Wait, from another thread.
+	virtual void Wake() {}
+	// Whether writes, except the last one to a file, must be a whole number of pages.
+	virtual bool Direct() const { return false; }
+
+protected:
+	void done(uint8_t const *data, size_t size, std::chrono::duration<double, std::milli> duration)
+	{
+		if (done_)
+			done_(data, size, duration);
+	}
+
+	VideoOptions const *options_;
+
+private:
+	DoneCallback done_;
+};
+
+// Writes data with stdio, finishing each write before returning.
+class StdioWriter : public FileWriter
+{
+public:
+	// When staged, FileOutput has already gathered the data into chunks, so we flush each
+	// write rather than let the tail of a recording wait in the FILE's buffer.
+	StdioWriter(VideoOptions const *options, DoneCallback const &done, bool staged = false);
+	~StdioWriter();
+	char const *Name() const override { return "stdio"; }
+	void Open(std::string const &filename) override;
+	void Write(uint8_t const *data, size_t size) override;
+	void Close() override;
+
+private:
+	FILE *fp_;
+	bool staged_;
+};
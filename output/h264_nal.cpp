@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * h264_nal.cpp - find NAL units in an H.264 byte stream.
+ */
+
+#include "h264_nal.hpp"
+
+size_t h264_next_start_code(uint8_t const *data, size_t size, size_t pos)
+{
+	while (pos + 3 <= size)
+	{
+		// If the third byte is more than 1, no start code can begin at any of these three bytes.
+		if (data[pos + 2] > 1)
+			pos += 3;
+		else if (data[pos + 2] == 1 && data[pos + 1] == 0 && data[pos] == 0)
+			return pos;
+		else
+			pos++;
+	}
+	return size;
+}
+
+std::vector<uint8_t> h264_find_headers(uint8_t const *data, size_t size)
+{
+	std::vector<uint8_t> headers;
+	size_t pos = h264_next_start_code(data, size, 0);
+	while (pos + 3 < size)
+	{
+		size_t start = pos + 3;
+		unsigned int type = data[start] & 0x1f;
+		// The headers come before any picture data, so there's no need to look further.
+		if (type >= 1 && type <= 5)
+			break;
+		pos = h264_next_start_code(data, size, start);
+		size_t end = pos;
+		while (end > start && data[end - 1] == 0)
+			end--;
+		if (type == 7 || type == 8)
+		{
+			headers.insert(headers.end(), { 0, 0, 0, 1 });
+			headers.insert(headers.end(), data + start, data + end);
+		}
+	}
+	return headers;
+}
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * h264_nal.hpp - find NAL units in an H.264 byte stream.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Return the offset of the next 00 00 01 start code at or after pos, or size if there isn't one.
+size_t h264_next_start_code(uint8_t const *data, size_t size, size_t pos);
+
+// Return the SPS and PPS NAL units (with start codes) from the start of an H.264 frame, so
+// that they can be given to clients that join the stream later.
+std::vector<uint8_t> h264_find_headers(uint8_t const *data, size_t size);
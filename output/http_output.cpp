@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * http_output.cpp - serve the stream to web browsers and other HTTP clients.
+ */
+
+#include <cstdio>
+#include <stdexcept>
+
+#include "h264_nal.hpp"
+#include "http_output.hpp"
+
+#define BOUNDARY "frame"
+
+HttpOutput::HttpOutput(VideoOptions const *options) : Output(options)
+{
+	// We listen on all interfaces, so only the port in http://<address>:<port> matters.
+	size_t colon = options->output.rfind(':');
+	int port = 0;
+	if (colon <= 4 || colon == std::string::npos || sscanf(options->output.c_str() + colon + 1, "%d", &port) != 1)
+		throw std::runtime_error("bad http address " + options->output);
+
+	std::string response = "HTTP/1.1 200 OK\r\n"
+						   "Cache-Control: no-cache, no-store\r\n"
+						   "Connection: close\r\n";
+	if (options->codec == "mjpeg")
+	{
+		mjpeg_ = true;
+		response += "Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY "\r\n\r\n";
+	}
+	else if (options->codec == "h264")
+	{
+		mjpeg_ = false;
+		response += "Content-Type: video/h264\r\nTransfer-Encoding: chunked\r\n\r\n";
+	}
+	else
+		throw std::runtime_error("http output supports only the mjpeg and h264 codecs");
+
+	server_ = std::make_unique<StreamServer>(port, options->client_queue, response);
+}
+
+void HttpOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// The clients share a single copy of the frame, which they keep until it's been sent.
+	outputEncodedBuffer(copy_encoded_buffer(mem, size, timestamp_us, flags & FLAG_KEYFRAME), timestamp_us, flags);
+}
+
+void HttpOutput::outputEncodedBuffer(EncodedBufferPtr const &buffer, int64_t timestamp_us, uint32_t flags)
+{
+	LOG(2, "HttpOutput: output buffer " << buffer->mem << " size " << buffer->size);
+	// An empty chunk would end a chunked response.
+	if (!buffer->size)
+		return;
+
+	char prefix[128];
+	if (mjpeg_)
+	{
+		snprintf(prefix, sizeof(prefix), "--" BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n",
+				 buffer->size);
+		// Every MJPEG frame is a keyframe.
+		server_->Send(StreamServer::MakeFrame(buffer, prefix, "\r\n"), true);
+		return;
+	}
+
+	// Clients that join later need the SPS and PPS, which may not come with every keyframe.
+	if (flags & FLAG_KEYFRAME)
+	{
+		std::vector<uint8_t> headers = h264_find_headers((uint8_t const *)buffer->mem, buffer->size);
+		if (!headers.empty())
+		{
+			snprintf(prefix, sizeof(prefix), "%zx\r\n", headers.size());
+			server_->SetHeaders(StreamServer::MakeFrame(
+				copy_encoded_buffer(headers.data(), headers.size(), timestamp_us, false), prefix, "\r\n"));
+		}
+	}
+
+	snprintf(prefix, sizeof(prefix), "%zx\r\n", buffer->size);
+	server_->Send(StreamServer::MakeFrame(buffer, prefix, "\r\n"), flags & FLAG_KEYFRAME);
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * http_output.hpp - serve the stream to web browsers and other HTTP clients.
+ */
+
+#pragma once
+
+#include <memory>
+
+#include "output.hpp"
+#include "stream_server.hpp"
+
+// MJPEG is served as multipart/x-mixed-replace, which browsers display directly, and H.264
+// as a chunked video/h264 response. Every request gets the stream, whatever its path.
+class HttpOutput : public Output
+{
+public:
+	HttpOutput(VideoOptions const *options);
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	void outputEncodedBuffer(EncodedBufferPtr const &buffer, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	bool mjpeg_;
+	std::unique_ptr<StreamServer> server_;
+};
@@ -8,9 +8,22 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include <random>
+#include <thread>
+
+#include "h264_nal.hpp"
 #include "net_output.hpp"
 
-NetOutput::NetOutput(VideoOptions const *options) : Output(options)
+// Overhead of the IPv4 and UDP headers.
+constexpr size_t UDP_HEADER_SIZE = 28;
+constexpr size_t RTP_HEADER_SIZE = 12;
+// RTP payload type for H.264, from the dynamic range.
+constexpr uint8_t RTP_PAYLOAD_TYPE = 96;
+constexpr uint8_t NAL_TYPE_FU_A = 28;
+
+NetOutput::NetOutput(VideoOptions const *options)
+	: Output(options), rtp_(false), abort_sender_(false), queue_warned_(false), frames_sent_(0), packets_sent_(0),
+	  send_calls_(0)
 {
 	char protocol[4];
 	int start, end, a, b, c, d, port;
@@ -18,7 +31,7 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 		throw std::runtime_error("bad network address " + options->output);
 	std::string address = options->output.substr(start, end - start);
 
-	if (strcmp(protocol, "udp") == 0)
+	if (strcmp(protocol, "udp") == 0 || strcmp(protocol, "rtp") == 0)
 	{
 		saddr_ = {};
 		saddr_.sin_family = AF_INET;
@@ -32,37 +45,45 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 		saddr_ptr_ = (const sockaddr *)&saddr_; // sendto needs these for udp
 		sockaddr_in_size_ = sizeof(sockaddr_in);
+
+		if (strcmp(protocol, "rtp") == 0)
+		{
+			if (options->codec != "h264")
+				throw std::runtime_error("rtp output supports only the h264 codec");
+			if (!options->inline_headers)
+				LOG_ERROR("WARNING: consider inline headers so that RTP receivers can join at any keyframe");
+
+			rtp_ = true;
+			max_packet_size_ = options->mtu - UDP_HEADER_SIZE;
+			batch_size_ = options->pacing ? PACED_BATCH : MAX_BATCH;
+			msgs_.resize(batch_size_);
+			std::random_device random;
+			sequence_ = random();
+			timestamp_offset_ = random();
+			ssrc_ = random();
+			pacing_time_ = std::chrono::steady_clock::now();
+
+			LOG(2, "NetOutput: RTP session description:\n"
+					   << "v=0\n"
+					   << "o=- " << ssrc_ << " 0 IN IP4 127.0.0.1\n"
+					   << "s=libcamera-vid\n"
+					   << "c=IN IP4 " << address << "\n"
+					   << "t=0 0\n"
+					   << "m=video " << port << " RTP/AVP " << (int)RTP_PAYLOAD_TYPE << "\n"
+					   << "a=rtpmap:" << (int)RTP_PAYLOAD_TYPE << " H264/90000\n"
+					   << "a=fmtp:" << (int)RTP_PAYLOAD_TYPE << " packetization-mode=1");
+
+			if (options->pacing)
+				sender_thread_ = std::thread(&NetOutput::senderThread, this);
+		}
 	}
 	else if (strcmp(protocol, "tcp") == 0)
 	{
-		// WARNING: I've not actually tried this yet...
 		if (options->listen)
 		{
-			// We are the server.
-			int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-			if (listen_fd < 0)
-				throw std::runtime_error("unable to open listen socket");
-
-			sockaddr_in server_saddr = {};
-			server_saddr.sin_family = AF_INET;
-			server_saddr.sin_addr.s_addr = INADDR_ANY;
-			server_saddr.sin_port = htons(port);
-
-			int enable = 1;
-			if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
-				throw std::runtime_error("failed to setsockopt listen socket");
-
-			if (bind(listen_fd, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
-				throw std::runtime_error("failed to bind listen socket");
-			listen(listen_fd, 1);
-
-			LOG(2, "Waiting for client to connect...");
-			fd_ = accept(listen_fd, (struct sockaddr *)&saddr_, &sockaddr_in_size_);
-			if (fd_ < 0)
-				throw std::runtime_error("accept socket failed");
-			LOG(2, "Client connection accepted");
-
-			close(listen_fd);
+			// We are the server, and clients can come and go as they please.
+			server_ = std::make_unique<StreamServer>(port, options->client_queue);
+			fd_ = -1;
 		}
 		else
 		{
@@ -92,15 +113,41 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 NetOutput::~NetOutput()
 {
-	close(fd_);
+	if (sender_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(send_mutex_);
+			abort_sender_ = true;
+		}
+		send_cond_var_.notify_one();
+		sender_thread_.join();
+	}
+	if (frames_sent_)
+		LOG(2, "NetOutput: sent " << frames_sent_ << " frames in " << packets_sent_ << " RTP packets, using "
+								  << send_calls_ << " system calls");
+	if (fd_ >= 0)
+		close(fd_);
 }
 
 // Maximum size that sendto will accept.
 constexpr size_t MAX_UDP_SIZE = 65507;
 
-void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
 	LOG(2, "NetOutput: output buffer " << mem << " size " << size);
+	if (rtp_)
+	{
+		sendRtp((uint8_t const *)mem, size, timestamp_us);
+		return;
+	}
+	else if (server_)
+	{
+		// The server has to keep the frame until every client has it.
+		outputEncodedBuffer(copy_encoded_buffer(mem, size, timestamp_us, flags & FLAG_KEYFRAME), timestamp_us,
+							flags);
+		return;
+	}
+
 	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
 	for (uint8_t *ptr = (uint8_t *)mem; size;)
 	{
@@ -111,3 +158,194 @@ void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, u
 		size -= bytes_to_send;
 	}
 }
+
+void NetOutput::outputEncodedBuffer(EncodedBufferPtr const &buffer, int64_t timestamp_us, uint32_t flags)
+{
+	if (!server_)
+	{
+		Output::outputEncodedBuffer(buffer, timestamp_us, flags);
+		return;
+	}
+
+	// Clients that join later need the SPS and PPS, which may not come with every keyframe.
+	if (options_->codec == "h264" && (flags & FLAG_KEYFRAME))
+	{
+		std::vector<uint8_t> headers = h264_find_headers((uint8_t const *)buffer->mem, buffer->size);
+		if (!headers.empty())
+			server_->SetHeaders(
+				StreamServer::MakeFrame(copy_encoded_buffer(headers.data(), headers.size(), timestamp_us, false)));
+	}
+
+	server_->Send(StreamServer::MakeFrame(buffer), flags & FLAG_KEYFRAME);
+}
+
+void NetOutput::sendRtp(uint8_t const *data, size_t size, int64_t timestamp_us)
+{
+	// With pacing, the sender thread sends the packets from a copy of the frame.
+	EncodedBufferPtr buffer;
+	if (sender_thread_.joinable())
+	{
+		buffer = copy_encoded_buffer(data, size, timestamp_us, false);
+		data = static_cast<uint8_t const *>(buffer->mem);
+	}
+
+	// RTP timestamps for video run at 90kHz.
+	timestamp_ = timestamp_offset_ + (uint32_t)(timestamp_us * 9 / 100);
+
+	packets_.clear();
+	size_t pos = h264_next_start_code(data, size, 0);
+	while (pos < size)
+	{
+		size_t start = pos + 3;
+		pos = h264_next_start_code(data, size, start);
+		// Drop the zero bytes before the next start code, which may be part of it.
+		size_t end = pos;
+		while (end > start && data[end - 1] == 0)
+			end--;
+		if (end > start)
+			sendNal(data + start, end - start, pos == size);
+	}
+	frames_sent_++;
+
+	if (!buffer)
+	{
+		if (!sendPackets(packets_))
+			throw std::runtime_error("failed to send data on socket");
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(send_mutex_);
+		send_queue_.push({ buffer, std::move(packets_) });
+		if (send_queue_.size() > MAX_SEND_QUEUE && !queue_warned_)
+		{
+			LOG_ERROR("WARNING: RTP pacing rate is too low to keep up with the video bitrate");
+			queue_warned_ = true;
+		}
+	}
+	send_cond_var_.notify_one();
+	packets_ = {};
+}
+
+void NetOutput::senderThread()
+{
+	while (true)
+	{
+		RtpFrame frame;
+		{
+			std::unique_lock<std::mutex> lock(send_mutex_);
+			send_cond_var_.wait(lock, [this] { return abort_sender_ || !send_queue_.empty(); });
+			// Anything still queued when we stop is sent first.
+			if (send_queue_.empty())
+				return;
+			frame = std::move(send_queue_.front());
+			send_queue_.pop();
+		}
+
+		if (!sendPackets(frame.packets))
+			LOG_ERROR("NetOutput: failed to send RTP packets for frame at " << frame.buffer->timestamp_us);
+	}
+}
+
+void NetOutput::sendNal(uint8_t const *nal, size_t size, bool last)
+{
+	size_t max_payload = max_packet_size_ - RTP_HEADER_SIZE;
+	if (size <= max_payload)
+	{
+		addPacket(nal, size, last, -1);
+		return;
+	}
+
+	// The NAL unit header is replaced by the FU indicator and FU header in each fragment.
+	uint8_t fu_indicator = (nal[0] & 0xe0) | NAL_TYPE_FU_A;
+	uint8_t nal_type = nal[0] & 0x1f;
+	nal++, size--;
+	for (bool first = true; size; first = false)
+	{
+		size_t n = std::min(size, max_payload - 2);
+		bool end = n == size;
+		uint8_t fu_header = (first ? 0x80 : 0) | (end ? 0x40 : 0) | nal_type;
+		addPacket(nal, n, last && end, (fu_indicator << 8) | fu_header);
+		nal += n;
+		size -= n;
+	}
+}
+
+void NetOutput::addPacket(uint8_t const *payload, size_t size, bool marker, int fu_header)
+{
+	packets_.emplace_back();
+	RtpPacket &packet = packets_.back();
+	uint8_t *header = packet.header;
+	header[0] = 0x80; // version 2
+	header[1] = (marker ? 0x80 : 0) | RTP_PAYLOAD_TYPE;
+	header[2] = sequence_ >> 8;
+	header[3] = sequence_ & 0xff;
+	header[4] = timestamp_ >> 24;
+	header[5] = (timestamp_ >> 16) & 0xff;
+	header[6] = (timestamp_ >> 8) & 0xff;
+	header[7] = timestamp_ & 0xff;
+	header[8] = ssrc_ >> 24;
+	header[9] = (ssrc_ >> 16) & 0xff;
+	header[10] = (ssrc_ >> 8) & 0xff;
+	header[11] = ssrc_ & 0xff;
+	packet.header_size = RTP_HEADER_SIZE;
+	if (fu_header >= 0)
+	{
+		header[12] = fu_header >> 8;
+		header[13] = fu_header & 0xff;
+		packet.header_size += 2;
+	}
+	packet.iov[1] = { const_cast<uint8_t *>(payload), size };
+	sequence_++;
+}
+
+// Send a frame's packets in batches. Returns false if the socket fails.
+bool NetOutput::sendPackets(std::vector<RtpPacket> &packets)
+{
+	for (size_t first = 0; first < packets.size(); first += batch_size_)
+	{
+		unsigned int num_packets = std::min<size_t>(batch_size_, packets.size() - first);
+		size_t bytes = 0;
+		for (unsigned int i = 0; i < num_packets; i++)
+		{
+			// The headers may have moved since the packets were made, so point at them only now.
+			RtpPacket &packet = packets[first + i];
+			packet.iov[0] = { packet.header, packet.header_size };
+			msgs_[i] = {};
+			msgs_[i].msg_hdr.msg_name = &saddr_;
+			msgs_[i].msg_hdr.msg_namelen = sockaddr_in_size_;
+			msgs_[i].msg_hdr.msg_iov = packet.iov;
+			msgs_[i].msg_hdr.msg_iovlen = 2;
+			bytes += packet.iov[0].iov_len + packet.iov[1].iov_len + UDP_HEADER_SIZE;
+		}
+
+		// Wait until the previous batch has had time to go at the pacing rate, then note when
+		// this one will have gone. Only the sender thread ever waits here.
+		if (options_->pacing)
+		{
+			auto now = std::chrono::steady_clock::now();
+			if (pacing_time_ > now)
+				std::this_thread::sleep_until(pacing_time_);
+			else
+				pacing_time_ = now;
+			pacing_time_ += std::chrono::nanoseconds(bytes * 8 * 1000000000 / options_->pacing.bps());
+		}
+
+		for (unsigned int sent = 0; sent < num_packets;)
+		{
+			int ret = sendmmsg(fd_, &msgs_[sent], num_packets - sent, 0);
+			send_calls_++;
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+			sent += ret;
+		}
+
+		packets_sent_ += num_packets;
+	}
+
+	return true;
+}
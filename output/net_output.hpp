@@ -8,8 +8,19 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
 
 #include "output.hpp"
+#include "stream_server.hpp"
 
 class NetOutput : public Output
 {
@@ -19,10 +30,61 @@ public:
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	void outputEncodedBuffer(EncodedBufferPtr const &buffer, int64_t timestamp_us, uint32_t flags) override;
 
 private:
 	int fd_;
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+	// In listen mode, the server looks after all the clients.
+	std::unique_ptr<StreamServer> server_;
+
+	// In RTP mode, each H.264 NAL unit goes in a packet of its own, or is split into FU-A
+	// fragments if it won't fit (RFC 6184), so that no packet is bigger than the MTU and a
+	// lost packet loses only part of one NAL unit. Packets are gathered up and sent in
+	// batches with sendmmsg, and their payloads are sent straight from the encoded frame.
+	void sendRtp(uint8_t const *data, size_t size, int64_t timestamp_us);
+	void sendNal(uint8_t const *nal, size_t size, bool last);
+	void addPacket(uint8_t const *payload, size_t size, bool marker, int fu_header);
+	static constexpr unsigned int MAX_BATCH = 64;
+	// With pacing, batches are small so that the packets are spread out smoothly.
+	static constexpr unsigned int PACED_BATCH = 4;
+	struct RtpPacket
+	{
+		uint8_t header[14]; // RTP header, plus the FU indicator and header for fragments
+		size_t header_size;
+		iovec iov[2];
+	};
+	// Pacing a large keyframe out takes a while (around 100ms for 250KB at 20Mbps), so the
+	// paced packets go from a thread of their own, leaving the encoder free to carry on.
+	// The frame is copied, as the encoder wants its buffer back before the packets have gone.
+	struct RtpFrame
+	{
+		EncodedBufferPtr buffer;
+		std::vector<RtpPacket> packets;
+	};
+	bool sendPackets(std::vector<RtpPacket> &packets);
+	void senderThread();
+	// Frames queued for the sender before we warn that the pacing rate is too low.
+	static constexpr unsigned int MAX_SEND_QUEUE = 30;
+	bool rtp_;
+	size_t max_packet_size_;
+	unsigned int batch_size_;
+	uint16_t sequence_;
+	uint32_t timestamp_;
+	uint32_t timestamp_offset_;
+	uint32_t ssrc_;
+	std::vector<RtpPacket> packets_;
+	std::vector<mmsghdr> msgs_;
+	std::chrono::steady_clock::time_point pacing_time_;
+	std::queue<RtpFrame> send_queue_;
+	std::mutex send_mutex_;
+	std::condition_variable send_cond_var_;
+	bool abort_sender_;
+	bool queue_warned_;
+	std::thread sender_thread_;
+	uint64_t frames_sent_;
+	uint64_t packets_sent_;
+	uint64_t send_calls_;
 };
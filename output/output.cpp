@@ -10,6 +10,7 @@
 
 #include "circular_output.hpp"
 #include "file_output.hpp"
+#include "http_output.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
 
@@ -53,9 +54,39 @@ void Output::Signal()
 }
 
 void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	int64_t output_timestamp;
+	uint32_t flags;
+	if (!startOutput(timestamp_us, keyframe, output_timestamp, flags))
+	{
+		skipOutput(timestamp_us);
+		return;
+	}
+
+	outputBuffer(mem, size, output_timestamp, flags);
+
+	finishOutput(timestamp_us);
+}
+
+void Output::BufferReady(EncodedBufferPtr const &buffer)
+{
+	int64_t output_timestamp;
+	uint32_t flags;
+	if (!startOutput(buffer->timestamp_us, buffer->keyframe, output_timestamp, flags))
+	{
+		skipOutput(buffer->timestamp_us);
+		return;
+	}
+
+	outputEncodedBuffer(buffer, output_timestamp, flags);
+
+	finishOutput(buffer->timestamp_us);
+}
+
+bool Output::startOutput(int64_t timestamp_us, bool keyframe, int64_t &output_timestamp, uint32_t &flags)
 {
 	// When output is enabled, we may have to wait for the next keyframe.
-	uint32_t flags = keyframe ? FLAG_KEYFRAME : FLAG_NONE;
+	flags = keyframe ? FLAG_KEYFRAME : FLAG_NONE;
 	if (!enable_)
 		state_ = DISABLED;
 	else if (state_ == DISABLED)
@@ -63,15 +94,18 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 	if (state_ == WAITING_KEYFRAME && keyframe)
 		state_ = RUNNING, flags |= FLAG_RESTART;
 	if (state_ != RUNNING)
-		return;
+		return false;
 
 	// Frig the timestamps to be continuous after a pause.
 	if (flags & FLAG_RESTART)
 		time_offset_ = timestamp_us - last_timestamp_;
 	last_timestamp_ = timestamp_us - time_offset_;
+	output_timestamp = last_timestamp_;
+	return true;
+}
 
-	outputBuffer(mem, size, last_timestamp_, flags);
-
+void Output::finishOutput(int64_t timestamp_us)
+{
 	// Save timestamps to a file, if that was requested.
 	if (fp_timestamps_)
 	{
@@ -80,13 +114,35 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 
 	if (!options_->metadata.empty())
 	{
-		libcamera::ControlList metadata = metadata_queue_.front();
-		write_metadata(buf_metadata_, options_->metadata_format, metadata, !metadata_started_);
-		metadata_started_ = true;
+		std::unique_lock<std::mutex> lock(metadata_mutex_);
+		// Anything older than this frame belongs to a frame that was never output.
+		while (!metadata_queue_.empty() && metadata_queue_.front().timestamp_us < timestamp_us)
+			metadata_queue_.pop();
+		if (metadata_queue_.empty() || metadata_queue_.front().timestamp_us != timestamp_us)
+		{
+			if (!metadata_warned_)
+				LOG_ERROR("WARNING: Output: no metadata for frame at " << timestamp_us << "us");
+			metadata_warned_ = true;
+			return;
+		}
+		MetadataItem item = std::move(metadata_queue_.front());
 		metadata_queue_.pop();
+		lock.unlock();
+
+		write_metadata(buf_metadata_, options_->metadata_format, item.metadata, !metadata_started_,
+					   item.extra_metadata);
+		metadata_started_ = true;
 	}
 }
 
+void Output::skipOutput(int64_t timestamp_us)
+{
+	// This frame won't be output, so nor will its metadata.
+	std::lock_guard<std::mutex> lock(metadata_mutex_);
+	while (!metadata_queue_.empty() && metadata_queue_.front().timestamp_us <= timestamp_us)
+		metadata_queue_.pop();
+}
+
 void Output::timestampReady(int64_t timestamp)
 {
 	fprintf(fp_timestamps_, "%" PRId64 ".%03" PRId64 "\n", timestamp / 1000, timestamp % 1000);
@@ -99,13 +155,21 @@ void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t
 	// Supply this so that a vanilla Output gives you an object that outputs no buffers.
 }
 
+void Output::outputEncodedBuffer(EncodedBufferPtr const &buffer, int64_t timestamp_us, uint32_t flags)
+{
+	outputBuffer(buffer->mem, buffer->size, timestamp_us, flags);
+}
+
 Output *Output::Create(VideoOptions const *options)
 {
 	if (options->codec == "libav")
 		return new Output(options);
 
-	if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0)
+	if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0 ||
+		strncmp(options->output.c_str(), "rtp://", 6) == 0)
 		return new NetOutput(options);
+	else if (strncmp(options->output.c_str(), "http://", 7) == 0)
+		return new HttpOutput(options);
 	else if (options->circular)
 		return new CircularOutput(options);
 	else if (!options->output.empty())
@@ -114,12 +178,14 @@ Output *Output::Create(VideoOptions const *options)
 		return new Output(options);
 }
 
-void Output::MetadataReady(libcamera::ControlList &metadata)
+void Output::MetadataReady(int64_t timestamp_us, libcamera::ControlList &metadata,
+						   CompletedRequest::ExtraMetadata &extra_metadata)
 {
 	if (options_->metadata.empty())
 		return;
 
-	metadata_queue_.push(metadata);
+	std::lock_guard<std::mutex> lock(metadata_mutex_);
+	metadata_queue_.push({ timestamp_us, metadata, extra_metadata });
 }
 
 void start_metadata_output(std::streambuf *buf, std::string fmt)
@@ -129,7 +195,8 @@ void start_metadata_output(std::streambuf *buf, std::string fmt)
 		out << "[" << std::endl;
 }
 
-void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write)
+void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write,
+					CompletedRequest::ExtraMetadata const &extra_metadata)
 {
 	std::ostream out(buf);
 	const libcamera::ControlIdMap *id_map = metadata.idMap();
@@ -137,6 +204,8 @@ void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList
 	{
 		for (auto const &[id, val] : metadata)
 			out << id_map->at(id)->name() << "=" << val.toString() << std::endl;
+		for (auto const &[name, value] : extra_metadata)
+			out << name << "=" << value << std::endl;
 		out << std::endl;
 	}
 	else
@@ -152,6 +221,11 @@ void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList
 				<< "    \"" << id_map->at(id)->name() << "\": " << arg_quote << val.toString() << arg_quote;
 			first_done = true;
 		}
+		for (auto const &[name, value] : extra_metadata)
+		{
+			out << (first_done ? "," : "") << std::endl << "    \"" << name << "\": " << value;
+			first_done = true;
+		}
 		out << std::endl << "}";
 	}
 }
@@ -10,9 +10,14 @@
 #include <cstdio>
 
 #include <atomic>
+#include <mutex>
+#include <queue>
 
+#include "core/completed_request.hpp"
 #include "core/video_options.hpp"
 
+#include "encoder/encoded_buffer.hpp"
+
 class Output
 {
 public:
@@ -22,7 +27,12 @@ public:
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
-	void MetadataReady(libcamera::ControlList &metadata);
+	// As OutputReady, but the Output may keep a reference to the buffer if it wants.
+	void BufferReady(EncodedBufferPtr const &buffer);
+	// The metadata for the frame that will be output with this timestamp. It must arrive
+	// before the frame itself does.
+	void MetadataReady(int64_t timestamp_us, libcamera::ControlList &metadata,
+					   CompletedRequest::ExtraMetadata &extra_metadata);
 
 protected:
 	enum Flag
@@ -32,11 +42,18 @@ protected:
 		FLAG_RESTART = 2
 	};
 	virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
+	// Outputs that want to hold on to encoded buffers, rather than finish with them before
+	// returning, should override this. By default it just calls outputBuffer.
+	virtual void outputEncodedBuffer(EncodedBufferPtr const &buffer, int64_t timestamp_us, uint32_t flags);
 	virtual void timestampReady(int64_t timestamp);
 	VideoOptions const *options_;
 	FILE *fp_timestamps_;
 
 private:
+	bool startOutput(int64_t timestamp_us, bool keyframe, int64_t &output_timestamp, uint32_t &flags);
+	void finishOutput(int64_t timestamp_us);
+	void skipOutput(int64_t timestamp_us);
+
 	enum State
 	{
 		DISABLED = 0,
@@ -50,9 +67,21 @@ private:
 	std::streambuf *buf_metadata_;
 	std::ofstream of_metadata_;
 	bool metadata_started_ = false;
-	std::queue<libcamera::ControlList> metadata_queue_;
+	// Pushed as frames go to the encoder, and popped on the output thread. Entries are
+	// matched to output frames by timestamp, so those of frames that never get output
+	// (dropped by the encoder, or skipped while paused) are discarded.
+	struct MetadataItem
+	{
+		int64_t timestamp_us;
+		libcamera::ControlList metadata;
+		CompletedRequest::ExtraMetadata extra_metadata;
+	};
+	std::mutex metadata_mutex_;
+	std::queue<MetadataItem> metadata_queue_;
+	bool metadata_warned_ = false;
 };
 
 void start_metadata_output(std::streambuf *buf, std::string fmt);
-void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write);
+void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write,
+					CompletedRequest::ExtraMetadata const &extra_metadata = {});
 void stop_metadata_output(std::streambuf *buf, std::string fmt);
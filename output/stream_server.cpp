@@ -0,0 +1,361 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * stream_server.cpp - serve encoded frames to any number of TCP clients.
+ */
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "core/logging.hpp"
+
+#include "stream_server.hpp"
+
+// Most frames to send to a client in one go.
+constexpr unsigned int MAX_FRAMES = 32;
+// Longest HTTP request that we'll accept.
+constexpr size_t MAX_REQUEST = 8192;
+
+StreamServer::StreamServer(int port, unsigned int max_queue, std::string const &http_response)
+	: max_queue_(max_queue), http_response_(http_response), abort_(false)
+{
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open listen socket");
+
+	sockaddr_in server_saddr = {};
+	server_saddr.sin_family = AF_INET;
+	server_saddr.sin_addr.s_addr = INADDR_ANY;
+	server_saddr.sin_port = htons(port);
+
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt listen socket");
+
+	if (bind(listen_fd_, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
+		throw std::runtime_error("failed to bind listen socket");
+	if (listen(listen_fd_, SOMAXCONN) < 0)
+		throw std::runtime_error("failed to listen on socket");
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("StreamServer: failed to create epoll or eventfd");
+
+	for (int fd : { listen_fd_, event_fd_ })
+	{
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+			throw std::runtime_error("StreamServer: failed to add to epoll");
+	}
+
+	server_thread_ = std::thread(&StreamServer::serverThread, this);
+	LOG(2, "StreamServer: listening on port " << port);
+}
+
+StreamServer::~StreamServer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	signal();
+	server_thread_.join();
+
+	while (!clients_.empty())
+		closeClient(clients_.begin()->first);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+}
+
+void StreamServer::SetHeaders(FramePtr const &headers)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	headers_ = headers;
+}
+
+void StreamServer::Send(FramePtr const &frame, bool keyframe)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto &[fd, client] : clients_)
+		{
+			if (!client.streaming || client.closing)
+				continue;
+			if (!client.waiting_keyframe && client.queue.size() >= max_queue_)
+			{
+				// Keep a frame that's partly sent, or the stream would be corrupted, and anything
+				// that isn't an encoded frame at all (such as the HTTP response). Headers go with
+				// their keyframe, and are sent again before the next one.
+				std::deque<FramePtr> kept;
+				for (unsigned int i = 0; i < client.queue.size(); i++)
+				{
+					if ((i == 0 && client.offset) || !client.queue[i]->buffer)
+						kept.push_back(std::move(client.queue[i]));
+				}
+				client.queue.swap(kept);
+				client.waiting_keyframe = true;
+				client.drops++;
+				LOG(2, "StreamServer: client " << fd << " fell behind, skipping to next keyframe");
+			}
+
+			if (client.waiting_keyframe)
+			{
+				if (!keyframe)
+					continue;
+				if (headers_)
+					client.queue.push_back(headers_);
+				client.waiting_keyframe = false;
+			}
+			client.queue.push_back(frame);
+		}
+	}
+
+	signal();
+}
+
+void StreamServer::signal()
+{
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG_ERROR("StreamServer: failed to signal server thread");
+}
+
+void StreamServer::serverThread()
+{
+	epoll_event events[16];
+	while (true)
+	{
+		int num_events = epoll_wait(epoll_fd_, events, 16, -1);
+		if (num_events < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("StreamServer: epoll_wait failed");
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::vector<int> closed;
+		for (int i = 0; i < num_events; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == event_fd_)
+			{
+				// New frames, so send them to everyone who's ready for them.
+				uint64_t count;
+				if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					LOG_ERROR("StreamServer: failed to read eventfd");
+				if (abort_)
+					return;
+				for (auto &[client_fd, client] : clients_)
+				{
+					if (!client.blocked && !sendQueued(client_fd, client))
+						closed.push_back(client_fd);
+				}
+			}
+			else if (fd == listen_fd_)
+				acceptClients();
+			else
+			{
+				auto it = clients_.find(fd);
+				if (it == clients_.end())
+					continue;
+				bool ok = !(events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP));
+				if (ok && (events[i].events & EPOLLIN))
+					ok = readRequest(fd, it->second);
+				if (ok && (events[i].events & EPOLLOUT))
+				{
+					setBlocked(fd, it->second, false);
+					ok = sendQueued(fd, it->second);
+				}
+				if (!ok)
+					closed.push_back(fd);
+			}
+		}
+
+		for (int fd : closed)
+			closeClient(fd);
+	}
+}
+
+void StreamServer::acceptClients()
+{
+	while (true)
+	{
+		int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOG_ERROR("StreamServer: accept failed");
+			return;
+		}
+
+		int enable = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLRDHUP;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			LOG_ERROR("StreamServer: failed to add client to epoll");
+			close(fd);
+			continue;
+		}
+
+		Client &client = clients_[fd];
+		client.offset = 0;
+		client.streaming = http_response_.empty();
+		client.waiting_keyframe = true;
+		client.blocked = false;
+		client.closing = false;
+		client.drops = 0;
+		LOG(2, "StreamServer: client " << fd << " connected, " << clients_.size() << " clients");
+	}
+}
+
+void StreamServer::closeClient(int fd)
+{
+	auto it = clients_.find(fd);
+	if (it == clients_.end())
+		return;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	LOG(2, "StreamServer: client " << fd << " disconnected (skipped ahead " << it->second.drops << " times), "
+									 << clients_.size() - 1 << " clients");
+	clients_.erase(it);
+}
+
+void StreamServer::setBlocked(int fd, Client &client, bool blocked)
+{
+	if (client.blocked == blocked)
+		return;
+	epoll_event event = {};
+	event.events = EPOLLIN | EPOLLRDHUP;
+	if (blocked)
+		event.events |= EPOLLOUT;
+	event.data.fd = fd;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event);
+	client.blocked = blocked;
+}
+
+// Read whatever the client sends. Returns false if the client should be disconnected.
+bool StreamServer::readRequest(int fd, Client &client)
+{
+	char buf[1024];
+	ssize_t ret;
+	while ((ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+	{
+		// Once the stream has started, we have no use for anything the client sends, but we
+		// must still notice if it goes away.
+		if (client.streaming || client.closing)
+			continue;
+
+		client.request.append(buf, ret);
+		if (client.request.find("\r\n\r\n") == std::string::npos)
+		{
+			if (client.request.size() > MAX_REQUEST)
+				return false;
+			continue;
+		}
+
+		// All requests get the stream, whatever the path, but we can't do anything else.
+		LOG(2, "StreamServer: client " << fd << " request " << client.request.substr(0, client.request.find('\r')));
+		if (client.request.compare(0, 4, "GET ") == 0)
+		{
+			client.queue.push_back(MakeFrame(nullptr, http_response_));
+			client.streaming = true;
+		}
+		else
+		{
+			client.queue.push_back(MakeFrame(nullptr, "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\n"
+													  "Content-Length: 0\r\nConnection: close\r\n\r\n"));
+			client.closing = true;
+		}
+		client.request.clear();
+		if (!client.blocked && !sendQueued(fd, client))
+			return false;
+	}
+
+	return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Send as much of the client's queue as the socket will take. Returns false if the client
+// should be disconnected.
+bool StreamServer::sendQueued(int fd, Client &client)
+{
+	while (!client.queue.empty())
+	{
+		// Each frame has up to three parts, and we skip what's already been sent.
+		iovec iov[3 * MAX_FRAMES];
+		unsigned int num_iov = 0, num_frames = 0;
+		size_t offset = client.offset;
+		for (auto it = client.queue.begin(); it != client.queue.end() && num_frames < MAX_FRAMES; it++, num_frames++)
+		{
+			Frame const &frame = **it;
+			std::pair<char const *, size_t> parts[] = {
+				{ frame.prefix.data(), frame.prefix.size() },
+				{ frame.buffer ? static_cast<char const *>(frame.buffer->mem) : nullptr,
+				  frame.buffer ? frame.buffer->size : 0 },
+				{ frame.suffix.data(), frame.suffix.size() },
+			};
+			for (auto const &[data, size] : parts)
+			{
+				if (offset >= size)
+				{
+					offset -= size;
+					continue;
+				}
+				iov[num_iov].iov_base = const_cast<char *>(data) + offset;
+				iov[num_iov].iov_len = size - offset;
+				num_iov++;
+				offset = 0;
+			}
+		}
+		// Empty frames have nothing to send, but still have to be let go below.
+		ssize_t sent = 0;
+		if (num_iov)
+		{
+			msghdr msg = {};
+			msg.msg_iov = iov;
+			msg.msg_iovlen = num_iov;
+			sent = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (sent < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					// Carry on when the socket has room again.
+					setBlocked(fd, client, true);
+					return true;
+				}
+				return false;
+			}
+		}
+
+		// Let go of the frames that have gone completely.
+		client.offset += sent;
+		while (!client.queue.empty() && client.offset >= client.queue.front()->Size())
+		{
+			client.offset -= client.queue.front()->Size();
+			client.queue.pop_front();
+		}
+	}
+
+	return !client.closing;
+}
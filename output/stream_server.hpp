@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * stream_server.hpp - serve encoded frames to any number of TCP clients.
+ */
+
+#pragma once
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "encoder/encoded_buffer.hpp"
+
+// Clients may connect and disconnect at any time. All the socket I/O happens in a single
+// thread, using epoll and non-blocking sockets, and each client has its own queue of frames
+// waiting to be sent, which hold the frames by reference rather than copying them.
+//
+// New clients start at the next keyframe, preceded by the stream headers (if there are
+// any). A client whose queue fills up because it can't keep up loses the frames it hasn't
+// started to receive, and restarts at the next keyframe, so that one slow client never holds
+// up the others, or the encoder.
+//
+// Given an HTTP response, the server expects each client to send a GET request first, and
+// sends the response before the stream.
+class StreamServer
+{
+public:
+	// An encoded frame with whatever framing the protocol needs around it. A frame is
+	// made once, and all the clients share it.
+	struct Frame
+	{
+		std::string prefix;
+		EncodedBufferPtr buffer;
+		std::string suffix;
+		size_t Size() const { return prefix.size() + (buffer ? buffer->size : 0) + suffix.size(); }
+	};
+	typedef std::shared_ptr<const Frame> FramePtr;
+	static FramePtr MakeFrame(EncodedBufferPtr const &buffer, std::string const &prefix = {},
+							  std::string const &suffix = {})
+	{
+		return std::make_shared<const Frame>(Frame { prefix, buffer, suffix });
+	}
+
+	StreamServer(int port, unsigned int max_queue, std::string const &http_response = {});
+	~StreamServer();
+	// Data to send before the first keyframe, such as the H.264 SPS and PPS.
+	void SetHeaders(FramePtr const &headers);
+	// Queue a frame for every client. This never blocks for long.
+	void Send(FramePtr const &frame, bool keyframe);
+
+private:
+	struct Client
+	{
+		std::deque<FramePtr> queue;
+		size_t offset; // amount of the first frame in the queue already sent
+		bool streaming; // false while we're still waiting for an HTTP request
+		bool waiting_keyframe;
+		bool blocked; // waiting for the socket to be writable
+		bool closing; // disconnect once the queue has gone
+		std::string request;
+		unsigned int drops;
+	};
+	void serverThread();
+	void acceptClients();
+	void closeClient(int fd);
+	bool readRequest(int fd, Client &client);
+	bool sendQueued(int fd, Client &client);
+	void setBlocked(int fd, Client &client, bool blocked);
+	void signal();
+
+	unsigned int max_queue_;
+	std::string http_response_;
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_;
+	std::mutex mutex_;
+	std::map<int, Client> clients_;
+	FramePtr headers_;
+	bool abort_;
+	std::thread server_thread_;
+};
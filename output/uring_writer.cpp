@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * uring_writer.cpp - write data to files asynchronously using io_uring.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "uring_writer.hpp"
+
+UringWriter::UringWriter(VideoOptions const *options, std::vector<uint8_t *> const &chunks, size_t chunk_size,
+						 DoneCallback const &done)
+	: FileWriter(options, done), registered_(false), in_flight_(0), wake_armed_(false), fd_(-1), direct_(false),
+	  offset_(0)
+{
+	// Every chunk can be in flight at once, and there's the wake-up poll too.
+	int ret = io_uring_queue_init(chunks.size() + 1, &ring_, 0);
+	if (ret < 0)
+		throw std::runtime_error(std::string("failed to set up io_uring: ") + strerror(-ret));
+
+	wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wake_fd_ < 0)
+	{
+		io_uring_queue_exit(&ring_);
+		throw std::runtime_error("failed to create eventfd for io_uring");
+	}
+
+	std::vector<iovec> iovecs;
+	for (unsigned int i = 0; i < chunks.size(); i++)
+	{
+		iovecs.push_back({ chunks[i], chunk_size });
+		buffer_index_[chunks[i]] = i;
+	}
+	requests_.resize(chunks.size());
+
+	// Registering the buffers counts against the locked memory limit, which may be too
+	// small. Plain writes still work, so we carry on without.
+	ret = io_uring_register_buffers(&ring_, iovecs.data(), iovecs.size());
+	if (ret < 0)
+		LOG(1, "FileOutput: unable to register io_uring buffers: " << strerror(-ret));
+	registered_ = ret == 0;
+
+	LOG(2, "FileOutput: using io_uring with " << chunks.size() << (registered_ ? " registered" : "") << " buffers");
+}
+
+UringWriter::~UringWriter()
+{
+	try
+	{
+		Close();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("FileOutput: " << e.what());
+	}
+	// Any outstanding wake-up poll is cancelled when the ring goes.
+	io_uring_queue_exit(&ring_);
+	close(wake_fd_);
+}
+
+void UringWriter::Open(std::string const &filename)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	direct_ = options_->output_direct;
+	fd_ = open(filename.c_str(), flags | (direct_ ? O_DIRECT : 0), 0666);
+	if (fd_ < 0 && direct_ && errno == EINVAL)
+	{
+		// Some filesystems, such as tmpfs, don't do direct I/O.
+		LOG(1, "FileOutput: direct I/O not supported for " << filename);
+		direct_ = false;
+		fd_ = open(filename.c_str(), flags, 0666);
+	}
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open output file " + filename);
+	offset_ = 0;
+
+	if (options_->output_preallocate)
+	{
+		off_t size = (off_t)options_->output_preallocate * 1024 * 1024;
+		if (fallocate(fd_, 0, 0, size) < 0)
+			LOG(1, "FileOutput: unable to preallocate " << filename << ": " << strerror(errno));
+	}
+
+	LOG(2, "FileOutput: opened output file " << filename << (direct_ ? " for direct I/O" : ""));
+}
+
+void UringWriter::Write(uint8_t const *data, size_t size)
+{
+	auto it = buffer_index_.find(data);
+	if (it == buffer_index_.end())
+		throw std::runtime_error("io_uring writes must come from the staging buffer");
+
+	if (fd_ < 0)
+	{
+		done(data, size, std::chrono::duration<double, std::milli>(0));
+		return;
+	}
+
+	Request &request = requests_[it->second];
+	request.data = data;
+	request.size = size;
+	request.length = size;
+	request.written = 0;
+	request.offset = offset_;
+	request.fd = fd_;
+	request.start = std::chrono::steady_clock::now();
+	if (direct_)
+	{
+		if (offset_ % DIRECT_ALIGN)
+		{
+			done(data, size, std::chrono::duration<double, std::milli>(0));
+			throw std::runtime_error("direct I/O write follows a partial page");
+		}
+		// The chunks are whole pages, so the last write to a file can be padded out to one
+		// and the padding removed when the file is closed.
+		request.length = (size + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+	}
+	offset_ += size;
+
+	submit(&request);
+
+	// Pick up any writes that have finished without waiting, so that their chunks can be
+	// reused as soon as possible.
+	io_uring_cqe *cqe;
+	while (io_uring_peek_cqe(&ring_, &cqe) == 0)
+		complete(cqe);
+}
+
+void UringWriter::submit(Request *request)
+{
+	// The ring has room for every chunk, so there's always a free entry.
+	io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+	uint8_t const *data = request->data + request->written;
+	unsigned int length = request->length - request->written;
+	off_t offset = request->offset + request->written;
+	if (registered_)
+		io_uring_prep_write_fixed(sqe, request->fd, data, length, offset, buffer_index_[request->data]);
+	else
+		io_uring_prep_write(sqe, request->fd, data, length, offset);
+	io_uring_sqe_set_data(sqe, request);
+	int ret = io_uring_submit(&ring_);
+	if (ret < 0)
+		throw std::runtime_error(std::string("io_uring submit failed: ") + strerror(-ret));
+	in_flight_++;
+}
+
+void UringWriter::armWake()
+{
+	if (wake_armed_)
+		return;
+	io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+	io_uring_prep_poll_add(sqe, wake_fd_, POLLIN);
+	io_uring_sqe_set_data(sqe, nullptr);
+	wake_armed_ = true;
+}
+
+void UringWriter::Wake()
+{
+	uint64_t one = 1;
+	if (write(wake_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG_ERROR("FileOutput: failed to wake io_uring writer");
+}
+
+void UringWriter::Wait()
+{
+	if (!in_flight_)
+		return;
+
+	armWake();
+	io_uring_submit(&ring_);
+	io_uring_cqe *cqe;
+	int ret = io_uring_wait_cqe(&ring_, &cqe);
+	if (ret == -EINTR)
+		return;
+	else if (ret < 0)
+		throw std::runtime_error(std::string("io_uring wait failed: ") + strerror(-ret));
+
+	do
+		complete(cqe);
+	while (io_uring_peek_cqe(&ring_, &cqe) == 0);
+}
+
+void UringWriter::complete(io_uring_cqe *cqe)
+{
+	Request *request = static_cast<Request *>(io_uring_cqe_get_data(cqe));
+	int res = cqe->res;
+	io_uring_cqe_seen(&ring_, cqe);
+
+	if (!request)
+	{
+		// The wake-up poll fired, so clear the eventfd.
+		uint64_t count;
+		wake_armed_ = false;
+		if (read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			LOG_ERROR("FileOutput: failed to read io_uring wake-up");
+		return;
+	}
+
+	in_flight_--;
+	if (res > 0 && request->written + res < request->length)
+	{
+		// A short write, so send the rest.
+		request->written += res;
+		submit(request);
+		return;
+	}
+
+	done(request->data, request->size, std::chrono::steady_clock::now() - request->start);
+	if (res < 0)
+		throw std::runtime_error(std::string("failed to write output bytes: ") + strerror(-res));
+	else if (res == 0)
+		throw std::runtime_error("failed to write output bytes");
+}
+
+void UringWriter::Close()
+{
+	while (in_flight_)
+		Wait();
+
+	if (fd_ < 0)
+		return;
+
+	// Remove any padding, or space that was reserved and not used.
+	if ((direct_ || options_->output_preallocate) && ftruncate(fd_, offset_) < 0)
+		LOG_ERROR("FileOutput: failed to truncate output file: " << strerror(errno));
+	if (options_->flush)
+		fdatasync(fd_);
+	close(fd_);
+	fd_ = -1;
+}
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * uring_writer.hpp - write data to files asynchronously using io_uring.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <map>
+#include <vector>
+
+#include <liburing.h>
+
+#include "file_writer.hpp"
+
+// Submits the writes to the kernel through an io_uring and lets them complete in the
+// background, so that several can be in progress at once. The chunks are registered with
+// the ring as fixed buffers, which saves mapping their pages for every write. Each write
+// goes to an explicit offset, so the order in which writes finish doesn't matter.
+//
+// Optionally, files are opened with O_DIRECT, bypassing the page cache, and space for them
+// can be reserved with fallocate when they're opened, so that the filesystem need not
+// allocate blocks as the file grows. Either way, the file is truncated to the size of the
+// data that was actually written when it's closed.
+class UringWriter : public FileWriter
+{
+public:
+	// Throws if there's no io_uring support, in which case the caller should use stdio.
+	UringWriter(VideoOptions const *options, std::vector<uint8_t *> const &chunks, size_t chunk_size,
+				DoneCallback const &done);
+	~UringWriter();
+	char const *Name() const override { return "io_uring"; }
+	void Open(std::string const &filename) override;
+	void Write(uint8_t const *data, size_t size) override;
+	void Close() override;
+	bool Busy() const override { return in_flight_ > 0; }
+	void Wait() override;
+	void Wake() override;
+	bool Direct() const override { return options_->output_direct; }
+
+private:
+	// Direct I/O must use offsets and lengths that are multiples of this.
+	static constexpr size_t DIRECT_ALIGN = 4096;
+
+	struct Request
+	{
+		uint8_t const *data;
+		size_t size; // amount of real data
+		size_t length; // amount to write, which may include padding
+		size_t written;
+		off_t offset;
+		int fd;
+		std::chrono::steady_clock::time_point start;
+	};
+	void submit(Request *request);
+	void armWake();
+	void complete(io_uring_cqe *cqe);
+
+	io_uring ring_;
+	bool registered_;
+	std::map<uint8_t const *, unsigned int> buffer_index_;
+	std::vector<Request> requests_;
+	unsigned int in_flight_;
+	// We can be woken from a Wait by writing to this eventfd, which we poll through the ring.
+	int wake_fd_;
+	bool wake_armed_;
+	int fd_;
+	bool direct_;
+	off_t offset_;
+};
@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * encode_roi_stage.cpp - tell the video encoder which regions matter most
+ */
+
+// Gathers regions of the image that deserve more (or fewer) bits from the video encoder.
+// They can be fixed rectangles from the JSON file (given as fractions of the image size,
+// optionally followed by their own qoffset), and/or the faces and objects found by earlier
+// stages ("detected_faces" and "object_detect.results", so list those stages first). The
+// regions go into the "encode_roi.regions" metadata, which the encoder picks up. Only
+// encoders that can vary their quantiser within a frame (such as libx264 through the libav
+// codec) make use of it.
+//
+// A negative qoffset (down to -1) means higher quality. Rectangles are given priority in
+// the order listed, followed by the faces and then the objects.
+
+#include <algorithm>
+
+#include <libcamera/geometry.h>
+#include <libcamera/stream.h>
+
+#include "core/libcamera_app.hpp"
+#include "core/region_of_interest.hpp"
+
+#include "post_processing_stages/object_detect.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Rectangle = libcamera::Rectangle;
+using Stream = libcamera::Stream;
+
+class EncodeRoiStage : public PostProcessingStage
+{
+public:
+	EncodeRoiStage(LibcameraApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	StreamInfo info_;
+	RegionsOfInterest rectangles_;
+	bool use_faces_;
+	std::vector<std::string> object_names_; // empty means all objects
+	bool use_objects_;
+	float confidence_;
+	float margin_;
+	float qoffset_;
+};
+
+#define NAME "encode_roi"
+
+char const *EncodeRoiStage::Name() const
+{
+	return NAME;
+}
+
+void EncodeRoiStage::Read(boost::property_tree::ptree const &params)
+{
+	qoffset_ = params.get<float>("qoffset", -0.5);
+	if (qoffset_ < -1 || qoffset_ > 1)
+		throw std::runtime_error("EncodeRoiStage: qoffset must be from -1 to 1");
+
+	if (params.count("rectangles"))
+	{
+		for (auto const &[unused, rect] : params.get_child("rectangles"))
+		{
+			std::vector<float> values;
+			for (auto const &[unused2, value] : rect)
+				values.push_back(value.get_value<float>());
+			if (values.size() != 4 && values.size() != 5)
+				throw std::runtime_error("EncodeRoiStage: rectangles need x, y, width, height and optional qoffset");
+			float qoffset = values.size() == 5 ? std::clamp(values[4], -1.0f, 1.0f) : qoffset_;
+			rectangles_.push_back({ values[0], values[1], values[2], values[3], qoffset });
+		}
+	}
+
+	use_faces_ = params.get<int>("faces", 0);
+	use_objects_ = params.count("objects");
+	if (use_objects_)
+	{
+		for (auto const &[unused, name] : params.get_child("objects"))
+			object_names_.push_back(name.get_value<std::string>());
+	}
+	confidence_ = params.get<float>("confidence_threshold", 0.5);
+	margin_ = params.get<float>("margin", 0.1);
+}
+
+void EncodeRoiStage::Configure()
+{
+	// Detections are given in pixels of the main image.
+	Stream *stream = app_->GetMainStream();
+	if (!stream)
+		throw std::runtime_error("EncodeRoiStage: no main stream");
+	info_ = app_->GetStreamInfo(stream);
+}
+
+bool EncodeRoiStage::Process(CompletedRequestPtr &completed_request)
+{
+	RegionsOfInterest regions = rectangles_;
+
+	auto add_detection = [this, &regions](Rectangle const &box) {
+		float dx = box.width * margin_, dy = box.height * margin_;
+		regions.push_back({ (box.x - dx) / info_.width, (box.y - dy) / info_.height,
+							(box.width + 2 * dx) / info_.width, (box.height + 2 * dy) / info_.height, qoffset_ });
+	};
+
+	if (use_faces_)
+	{
+		std::vector<Rectangle> faces;
+		if (completed_request->post_process_metadata.Get("detected_faces", faces) == 0)
+			std::for_each(faces.begin(), faces.end(), add_detection);
+	}
+
+	if (use_objects_)
+	{
+		std::vector<Detection> detections;
+		if (completed_request->post_process_metadata.Get("object_detect.results", detections) == 0)
+		{
+			for (auto const &detection : detections)
+			{
+				if (detection.confidence < confidence_)
+					continue;
+				if (object_names_.empty() ||
+					std::find(object_names_.begin(), object_names_.end(), detection.name) != object_names_.end())
+					add_detection(detection.box);
+			}
+		}
+	}
+
+	if (!regions.empty())
+		completed_request->post_process_metadata.Set("encode_roi.regions", regions);
+
+	return false;
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new EncodeRoiStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -17,6 +17,7 @@
 
 #include "core/libcamera_app.hpp"
 
+#include "post_processing_stages/image_cache.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include "opencv2/imgproc.hpp"
@@ -52,7 +53,7 @@ private:
 	std::unique_ptr<std::future<void>> future_ptr_;
 	std::mutex face_mutex_;
 	std::mutex future_ptr_mutex_;
-	Mat image_;
+	std::shared_ptr<ImageCache> image_cache_;
 	std::vector<cv::Rect> faces_;
 	CascadeClassifier cascade_;
 	std::string cascadeName_;
@@ -120,11 +121,9 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 		if (completed_request->sequence % refresh_rate_ == 0 &&
 			(!future_ptr_ || future_ptr_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
-			BufferReadSync r(app_, completed_request->buffers[stream_]);
-			libcamera::Span<uint8_t> buffer = r.Get()[0];
-			uint8_t *ptr = (uint8_t *)buffer.data();
-			Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
-			image_ = image.clone();
+			// The equalised image is made in the detection thread, unless another stage
+			// has already asked the cache for it.
+			image_cache_ = GetImageCache(completed_request, stream_);
 
 			future_ptr_ = std::make_unique<std::future<void>>();
 			*future_ptr_ = std::async(std::launch::async, [this] { detectFeatures(cascade_); });
@@ -152,10 +151,12 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 
 void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
 {
-	equalizeHist(image_, image_);
+	std::shared_ptr<const LumaImage> luma = image_cache_->EqualisedLuma();
+	// The classifier only reads the image, so it's safe to drop the const here.
+	Mat image(luma->height, luma->width, CV_8U, const_cast<uint8_t *>(luma->data.data()));
 
 	std::vector<Rect> temp_faces;
-	cascade.detectMultiScale(image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
+	cascade.detectMultiScale(image, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
 							 Size(min_size_, min_size_), Size(max_size_, max_size_));
 
 	// Scale faces back to the size and location in the full res image.
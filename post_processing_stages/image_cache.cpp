@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * image_cache.cpp - images derived from a request buffer, shared between stages
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "post_processing_stages/image_cache.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+ImageCache::ImageCache(libcamera::Span<uint8_t> const &buffer, StreamInfo const &info) : info_(info)
+{
+	// Copy only the image itself, not any padding at the end of the buffer. This is the
+	// only time the camera buffer gets read.
+	size_t size = info_.stride * info_.height + 2 * (info_.stride / 2) * (info_.height / 2);
+	size = std::min(size, buffer.size());
+	yuv420_ = std::make_shared<const std::vector<uint8_t>>(buffer.data(), buffer.data() + size);
+}
+
+std::shared_ptr<const std::vector<uint8_t>> ImageCache::Rgb(unsigned int width, unsigned int height)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto &rgb = rgb_[{ width, height }];
+	if (!rgb)
+	{
+		StreamInfo src_info = info_;
+		StreamInfo dst_info;
+		dst_info.width = width, dst_info.height = height, dst_info.stride = width * 3;
+		rgb = std::make_shared<const std::vector<uint8_t>>(
+			PostProcessingStage::Yuv420ToRgb(yuv420_->data(), src_info, dst_info));
+	}
+
+	return rgb;
+}
+
+std::shared_ptr<const LumaImage> ImageCache::Luma(unsigned int level)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return luma(level);
+}
+
+std::shared_ptr<const LumaImage> ImageCache::luma(unsigned int level)
+{
+	if (level < luma_.size())
+		return luma_[level];
+
+	auto image = std::make_shared<LumaImage>();
+	if (level == 0)
+	{
+		// Strip the padding from the end of each row.
+		image->width = info_.width;
+		image->height = info_.height;
+		image->data.resize(image->width * image->height);
+		for (unsigned int y = 0; y < image->height; y++)
+			std::copy_n(yuv420_->data() + y * info_.stride, image->width, &image->data[y * image->width]);
+	}
+	else
+	{
+		// Each level is a 2x2 box filter of the one above.
+		std::shared_ptr<const LumaImage> src = luma(level - 1);
+		image->width = src->width / 2;
+		image->height = src->height / 2;
+		if (!image->width || !image->height)
+			throw std::runtime_error("ImageCache: too many luma pyramid levels requested");
+		image->data.resize(image->width * image->height);
+		for (unsigned int y = 0; y < image->height; y++)
+		{
+			const uint8_t *src0 = &src->data[2 * y * src->width];
+			const uint8_t *src1 = src0 + src->width;
+			uint8_t *dst = &image->data[y * image->width];
+			for (unsigned int x = 0; x < image->width; x++)
+				dst[x] = (src0[2 * x] + src0[2 * x + 1] + src1[2 * x] + src1[2 * x + 1] + 2) >> 2;
+		}
+	}
+
+	luma_.resize(level + 1);
+	luma_[level] = image;
+	return image;
+}
+
+std::shared_ptr<const LumaImage> ImageCache::EqualisedLuma()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (equalised_luma_)
+		return equalised_luma_;
+
+	// This produces the same result as OpenCV's equalizeHist.
+	std::shared_ptr<const LumaImage> src = luma(0);
+	uint32_t hist[256] = {};
+	for (uint8_t value : src->data)
+		hist[value]++;
+
+	uint8_t lut[256];
+	unsigned int total = src->data.size(), first = 0;
+	while (first < 255 && !hist[first])
+		first++;
+	if (hist[first] == total)
+		std::fill_n(lut, 256, first);
+	else
+	{
+		float scale = 255.0f / (total - hist[first]);
+		unsigned int sum = 0;
+		std::fill_n(lut, first + 1, 0);
+		for (unsigned int i = first + 1; i < 256; i++)
+		{
+			sum += hist[i];
+			lut[i] = std::clamp<int>(std::lround(sum * scale), 0, 255);
+		}
+	}
+
+	auto image = std::make_shared<LumaImage>();
+	image->width = src->width;
+	image->height = src->height;
+	image->data.resize(src->data.size());
+	for (unsigned int i = 0; i < src->data.size(); i++)
+		image->data[i] = lut[src->data[i]];
+
+	equalised_luma_ = image;
+	return image;
+}
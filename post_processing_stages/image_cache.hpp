@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * image_cache.hpp - images derived from a request buffer, shared between stages
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <libcamera/base/span.h>
+
+#include "core/stream_info.hpp"
+
+// Several post-processing stages typically want the same things from the low resolution
+// stream: a copy in cached memory (reading the camera buffers directly is slow), an RGB
+// version for a neural network, or a greyscale image for OpenCV. The ImageCache makes each
+// of these just once per request, the first time any stage asks for it, and hands them out
+// as shared pointers so that stages' asynchronous threads can hold on to them for as long
+// as they need, even after the request itself has been returned to the camera.
+//
+// The cache only ever reads the camera buffer when it is created, so every derived image
+// comes from cached memory. Only YUV420 images are supported.
+
+struct LumaImage
+{
+	unsigned int width;
+	unsigned int height;
+	// Rows are packed, so the stride is always the same as the width.
+	std::vector<uint8_t> data;
+};
+
+class ImageCache
+{
+public:
+	// Copy the image out of the (uncached) camera buffer.
+	ImageCache(libcamera::Span<uint8_t> const &buffer, StreamInfo const &info);
+
+	StreamInfo const &Info() const { return info_; }
+
+	// The whole YUV420 image, in cached memory.
+	std::shared_ptr<const std::vector<uint8_t>> Yuv420() const { return yuv420_; }
+
+	// An RGB image of this size, cropped from the centre just like Yuv420ToRgb.
+	std::shared_ptr<const std::vector<uint8_t>> Rgb(unsigned int width, unsigned int height);
+
+	// The luma plane, downscaled by a factor of 2 in each direction for every level.
+	// Level 0 is the full size image.
+	std::shared_ptr<const LumaImage> Luma(unsigned int level = 0);
+
+	// The full size luma plane after histogram equalisation.
+	std::shared_ptr<const LumaImage> EqualisedLuma();
+
+private:
+	std::shared_ptr<const LumaImage> luma(unsigned int level);
+
+	StreamInfo info_;
+	std::shared_ptr<const std::vector<uint8_t>> yuv420_;
+	// Stages may call us from their own threads, so everything below needs the lock.
+	std::mutex mutex_;
+	std::map<std::pair<unsigned int, unsigned int>, std::shared_ptr<const std::vector<uint8_t>>> rgb_;
+	std::vector<std::shared_ptr<const LumaImage>> luma_;
+	std::shared_ptr<const LumaImage> equalised_luma_;
+};
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * luma_stats.hpp - per-frame luma statistics result
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+struct LumaStats
+{
+	// Histogram of the (subsampled) luma values, with 256 / histogram.size() levels per bin.
+	std::vector<uint32_t> histogram;
+	// Average luma over the whole image, and for each of the zones_x * zones_y zones
+	// (in raster order).
+	float mean;
+	unsigned int zones_x;
+	unsigned int zones_y;
+	std::vector<float> zone_means;
+	// The average absolute difference between neighbouring pixels, which goes up as the
+	// image gets sharper. Only useful for comparing frames of the same scene.
+	float sharpness;
+};
@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * luma_stats_stage.cpp - per-frame luma statistics
+ */
+
+// Calculates some cheap statistics from the luma of the low resolution image: a histogram,
+// the average level in each of a grid of zones, and a sharpness figure. These are attached
+// to the request as "luma_stats.result" for other stages or the application to use, and can
+// optionally be written to the --metadata output too.
+
+// The histogram can be subsampled with hskip and vskip, and the zone means and sharpness are
+// calculated on every vskip'th row. Every row is processed with plain loops over contiguous
+// pixels, which the compiler vectorises.
+
+#include <sstream>
+
+#include <libcamera/stream.h>
+
+#include "core/libcamera_app.hpp"
+
+#include "post_processing_stages/image_cache.hpp"
+#include "post_processing_stages/luma_stats.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+class LumaStatsStage : public PostProcessingStage
+{
+public:
+	LumaStatsStage(LibcameraApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	void calculate(const uint8_t *image, LumaStats &stats);
+
+	Stream *stream_;
+	StreamInfo info_;
+	unsigned int bins_;
+	unsigned int zones_x_, zones_y_;
+	unsigned int hskip_, vskip_;
+	unsigned int frame_period_;
+	bool output_metadata_;
+	bool verbose_;
+	// Zone boundaries (in pixels) in each direction, with one extra entry at the end.
+	std::vector<unsigned int> zone_x_start_, zone_y_start_;
+};
+
+#define NAME "luma_stats"
+
+char const *LumaStatsStage::Name() const
+{
+	return NAME;
+}
+
+void LumaStatsStage::Read(boost::property_tree::ptree const &params)
+{
+	bins_ = params.get<unsigned int>("histogram_bins", 64);
+	zones_x_ = params.get<unsigned int>("zones_x", 8);
+	zones_y_ = params.get<unsigned int>("zones_y", 6);
+	hskip_ = params.get<unsigned int>("hskip", 2);
+	vskip_ = params.get<unsigned int>("vskip", 2);
+	frame_period_ = params.get<unsigned int>("frame_period", 1);
+	output_metadata_ = params.get<int>("output_metadata", 0);
+	verbose_ = params.get<int>("verbose", 0);
+
+	if (bins_ < 1 || bins_ > 256 || (bins_ & (bins_ - 1)))
+		throw std::runtime_error("LumaStatsStage: histogram_bins must be a power of 2 no larger than 256");
+	if (!zones_x_ || !zones_y_)
+		throw std::runtime_error("LumaStatsStage: zones_x and zones_y must be non-zero");
+	hskip_ = std::max(hskip_, 1u);
+	vskip_ = std::max(vskip_, 1u);
+}
+
+void LumaStatsStage::Configure()
+{
+	stream_ = app_->LoresStream(&info_);
+	if (!stream_)
+		return;
+
+	zones_x_ = std::min(zones_x_, info_.width);
+	zones_y_ = std::min(zones_y_, info_.height);
+	zone_x_start_.resize(zones_x_ + 1);
+	zone_y_start_.resize(zones_y_ + 1);
+	for (unsigned int i = 0; i <= zones_x_; i++)
+		zone_x_start_[i] = i * info_.width / zones_x_;
+	for (unsigned int i = 0; i <= zones_y_; i++)
+		zone_y_start_[i] = i * info_.height / zones_y_;
+
+	if (verbose_)
+		LOG(1, "LumaStatsStage: " << info_.width << "x" << info_.height << " image, " << zones_x_ << "x" << zones_y_
+								  << " zones, " << bins_ << " histogram bins");
+}
+
+void LumaStatsStage::calculate(const uint8_t *image, LumaStats &stats)
+{
+	unsigned int shift = 0;
+	while ((256u >> shift) > bins_)
+		shift++;
+
+	// Using several histograms, and summing them at the end, avoids every increment having
+	// to wait for the previous one when neighbouring pixels are similar.
+	std::vector<uint32_t> hist[4];
+	for (auto &h : hist)
+		h.assign(bins_, 0);
+	std::vector<uint64_t> zone_sums(zones_x_ * zones_y_, 0);
+	std::vector<uint32_t> zone_counts(zones_x_ * zones_y_, 0);
+	uint64_t gradient_sum = 0, gradient_count = 0;
+
+	unsigned int zy = 0;
+	for (unsigned int y = 0; y < info_.height; y += vskip_)
+	{
+		const uint8_t *row = image + y * info_.stride;
+
+		while (y >= zone_y_start_[zy + 1])
+			zy++;
+		for (unsigned int zx = 0; zx < zones_x_; zx++)
+		{
+			uint32_t sum = 0;
+			for (unsigned int x = zone_x_start_[zx]; x < zone_x_start_[zx + 1]; x++)
+				sum += row[x];
+			zone_sums[zy * zones_x_ + zx] += sum;
+			zone_counts[zy * zones_x_ + zx] += zone_x_start_[zx + 1] - zone_x_start_[zx];
+		}
+
+		uint32_t gradient = 0;
+		for (unsigned int x = 0; x < info_.width - 1; x++)
+			gradient += std::abs(row[x + 1] - row[x]);
+		gradient_count += info_.width - 1;
+		if (y + 1 < info_.height)
+		{
+			const uint8_t *next_row = row + info_.stride;
+			for (unsigned int x = 0; x < info_.width; x++)
+				gradient += std::abs(next_row[x] - row[x]);
+			gradient_count += info_.width;
+		}
+		gradient_sum += gradient;
+
+		unsigned int x = 0;
+		for (; x + 3 * hskip_ < info_.width; x += 4 * hskip_)
+		{
+			hist[0][row[x] >> shift]++;
+			hist[1][row[x + hskip_] >> shift]++;
+			hist[2][row[x + 2 * hskip_] >> shift]++;
+			hist[3][row[x + 3 * hskip_] >> shift]++;
+		}
+		for (; x < info_.width; x += hskip_)
+			hist[0][row[x] >> shift]++;
+	}
+
+	stats.histogram.resize(bins_);
+	for (unsigned int i = 0; i < bins_; i++)
+		stats.histogram[i] = hist[0][i] + hist[1][i] + hist[2][i] + hist[3][i];
+
+	uint64_t total_sum = 0, total_count = 0;
+	stats.zones_x = zones_x_;
+	stats.zones_y = zones_y_;
+	stats.zone_means.resize(zone_sums.size());
+	for (unsigned int i = 0; i < zone_sums.size(); i++)
+	{
+		stats.zone_means[i] = zone_counts[i] ? (float)zone_sums[i] / zone_counts[i] : 0;
+		total_sum += zone_sums[i];
+		total_count += zone_counts[i];
+	}
+	stats.mean = total_count ? (float)total_sum / total_count : 0;
+	stats.sharpness = gradient_count ? (float)gradient_sum / gradient_count : 0;
+}
+
+template <typename T>
+static std::string json_array(std::vector<T> const &values)
+{
+	std::stringstream ss;
+	ss.precision(4);
+	ss << "[";
+	for (unsigned int i = 0; i < values.size(); i++)
+		ss << (i ? ", " : "") << values[i];
+	ss << "]";
+	return ss.str();
+}
+
+bool LumaStatsStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	if (frame_period_ > 1 && completed_request->sequence % frame_period_)
+		return false;
+
+	std::shared_ptr<const std::vector<uint8_t>> yuv420 = GetImageCache(completed_request, stream_)->Yuv420();
+	LumaStats stats;
+	auto time_taken = ExecutionTime<std::micro>(&LumaStatsStage::calculate, this, yuv420->data(), stats).count();
+
+	if (verbose_)
+		LOG(1, "LumaStatsStage: mean " << stats.mean << " sharpness " << stats.sharpness << " in " << time_taken
+									   << "us");
+
+	if (output_metadata_)
+	{
+		std::stringstream mean, sharpness;
+		mean << stats.mean;
+		sharpness << stats.sharpness;
+		completed_request->extra_metadata["LumaMean"] = mean.str();
+		completed_request->extra_metadata["LumaHistogram"] = json_array(stats.histogram);
+		completed_request->extra_metadata["LumaZoneMeans"] = json_array(stats.zone_means);
+		completed_request->extra_metadata["Sharpness"] = sharpness.str();
+	}
+
+	completed_request->post_process_metadata.Set("luma_stats.result", std::move(stats));
+
+	return false;
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new LumaStatsStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
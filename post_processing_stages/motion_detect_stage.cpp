@@ -24,6 +24,7 @@
 
 #include "core/libcamera_app.hpp"
 
+#include "post_processing_stages/image_cache.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 using Stream = libcamera::Stream;
@@ -133,9 +134,9 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 	if (config_.frame_period && completed_request->sequence % config_.frame_period)
 		return false;
 
-	BufferReadSync r(app_, completed_request->buffers[stream_]);
-	libcamera::Span<uint8_t> buffer = r.Get()[0];
-	uint8_t *image = buffer.data();
+	// Use the shared copy of the image in cached memory, which other stages may also be using.
+	std::shared_ptr<const std::vector<uint8_t>> yuv420 = GetImageCache(completed_request, stream_)->Yuv420();
+	const uint8_t *image = yuv420->data();
 
 	// We need to protect access to first_time_, previous_frame_ and motion_detected_.
 	std::lock_guard<std::mutex> lock(mutex_);
@@ -145,7 +146,7 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 		first_time_ = false;
 		for (unsigned int y = 0; y < roi_height_; y++)
 		{
-			uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
+			const uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
 			uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
 			for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
 				*(old_value_ptr++) = *new_value_ptr;
@@ -163,7 +164,7 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 	// exceeds the threshold. At the same time, update the previous image buffer.
 	for (unsigned int y = 0; y < roi_height_; y++)
 	{
-		uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
+		const uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
 		uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
 		for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
 		{
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * pixel_kernel.hpp - run simple per-pixel kernels over image planes
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <array>
+
+#include "post_processing_stages/row_band_pool.hpp"
+
+// A kernel is any type with a const operator() that processes a single row (or, for the
+// two plane version, a pair of matching rows) in place. Everything here is templated on the
+// kernel type so that the kernel's row loop gets inlined into the loop over rows, with no
+// per-row or per-pixel function calls, which leaves the compiler free to unroll and
+// vectorise it.
+
+template <typename Kernel>
+void ApplyKernel(Kernel const &kernel, uint8_t *plane, unsigned int width, unsigned int height, unsigned int stride,
+				 RowBandPool &pool)
+{
+	pool.Run(height, [&](unsigned int y0, unsigned int y1) {
+		for (unsigned int y = y0; y < y1; y++)
+			kernel(plane + y * stride, width);
+	});
+}
+
+template <typename Kernel>
+void ApplyKernel(Kernel const &kernel, uint8_t *plane0, uint8_t *plane1, unsigned int width, unsigned int height,
+				 unsigned int stride, RowBandPool &pool)
+{
+	pool.Run(height, [&](unsigned int y0, unsigned int y1) {
+		for (unsigned int y = y0; y < y1; y++)
+			kernel(plane0 + y * stride, plane1 + y * stride, width);
+	});
+}
+
+// Replace every pixel by a table lookup. Any chain of point operations on 8-bit values
+// reduces to one of these.
+struct LutKernel
+{
+	std::array<uint8_t, 256> lut;
+
+	void operator()(uint8_t *row, unsigned int width) const
+	{
+		for (unsigned int x = 0; x < width; x++)
+			row[x] = lut[row[x]];
+	}
+};
+
+// Apply a table to each of U and V, then a 2x2 matrix to the (signed) chroma pair. The
+// matrix is in fixed point with Shift fractional bits.
+struct ChromaMatrixKernel
+{
+	static constexpr int Shift = 10;
+
+	std::array<uint8_t, 256> lut_u;
+	std::array<uint8_t, 256> lut_v;
+	std::array<int, 4> matrix;
+
+	void operator()(uint8_t *u_row, uint8_t *v_row, unsigned int width) const
+	{
+		constexpr int round = 1 << (Shift - 1);
+		for (unsigned int x = 0; x < width; x++)
+		{
+			int u = lut_u[u_row[x]] - 128, v = lut_v[v_row[x]] - 128;
+			int u_out = ((matrix[0] * u + matrix[1] * v + round) >> Shift) + 128;
+			int v_out = ((matrix[2] * u + matrix[3] * v + round) >> Shift) + 128;
+			u_row[x] = std::clamp(u_out, 0, 255);
+			v_row[x] = std::clamp(v_out, 0, 255);
+		}
+	}
+};
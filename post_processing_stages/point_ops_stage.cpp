@@ -0,0 +1,195 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * point_ops_stage.cpp - chains of per-pixel operations on the main image
+ */
+
+// Applies a chain of point operations (gain, offset, contrast, gamma, curves, thresholds and
+// so on) to each of the Y, U and V planes of the main image, for example:
+//
+// "point_ops" : { "y" : [ { "gamma" : 1.2 }, { "contrast" : 1.1 } ], "saturation" : 1.3 }
+//
+// However many operations are listed, they are composed into a single lookup table per plane
+// when the stage is configured, so the image only ever gets one pass. The chroma planes can
+// additionally be mixed by a 2x2 matrix (for saturation or hue changes), which happens in the
+// same pass. The rows are split into bands that are processed in parallel.
+
+#include <cmath>
+#include <functional>
+#include <memory>
+
+#include <libcamera/formats.h>
+#include <libcamera/stream.h>
+
+#include "core/libcamera_app.hpp"
+
+#include "post_processing_stages/pixel_kernel.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+#include "post_processing_stages/pwl.hpp"
+
+using Stream = libcamera::Stream;
+
+class PointOpsStage : public PostProcessingStage
+{
+public:
+	PointOpsStage(LibcameraApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	Stream *stream_;
+	StreamInfo info_;
+	std::unique_ptr<RowBandPool> pool_;
+	LutKernel y_kernel_;
+	ChromaMatrixKernel uv_kernel_;
+	// We skip whatever doesn't actually change anything.
+	bool y_identity_;
+	bool u_identity_, v_identity_, matrix_identity_;
+};
+
+#define NAME "point_ops"
+
+char const *PointOpsStage::Name() const
+{
+	return NAME;
+}
+
+// Compose the listed operations into a single table. Values are kept in floating point
+// between operations, but clipped to the valid range after each one, just as they would
+// be if each operation were a separate pass.
+static std::array<uint8_t, 256> compose_ops(boost::property_tree::ptree const &ops)
+{
+	std::array<double, 256> values;
+	for (unsigned int i = 0; i < 256; i++)
+		values[i] = i;
+
+	for (auto const &[unused, op_tree] : ops)
+	{
+		if (op_tree.size() != 1)
+			throw std::runtime_error("PointOpsStage: each operation must have exactly one entry");
+		auto const &[op, param] = *op_tree.begin();
+
+		std::function<double(double)> f;
+		if (op == "negate")
+			f = [](double v) { return 255 - v; };
+		else if (op == "gain")
+			f = [g = param.get_value<double>()](double v) { return v * g; };
+		else if (op == "offset")
+			f = [o = param.get_value<double>()](double v) { return v + o; };
+		else if (op == "contrast") // around mid-grey
+			f = [c = param.get_value<double>()](double v) { return (v - 128) * c + 128; };
+		else if (op == "gamma") // values above 1 brighten
+			f = [g = param.get_value<double>()](double v) { return 255 * pow(v / 255, 1 / g); };
+		else if (op == "threshold")
+			f = [t = param.get_value<double>()](double v) { return v >= t ? 255 : 0; };
+		else if (op == "curve") // a Pwl, given as a flat list of x, y pairs
+		{
+			Pwl curve;
+			curve.Read(param);
+			f = [curve](double v) { return curve.Eval(curve.Domain().Clip(v)); };
+		}
+		else
+			throw std::runtime_error("PointOpsStage: unknown operation " + op);
+
+		for (auto &v : values)
+			v = std::clamp(f(v), 0.0, 255.0);
+	}
+
+	std::array<uint8_t, 256> lut;
+	for (unsigned int i = 0; i < 256; i++)
+		lut[i] = std::lround(values[i]);
+	return lut;
+}
+
+static bool is_identity(std::array<uint8_t, 256> const &lut)
+{
+	for (unsigned int i = 0; i < 256; i++)
+		if (lut[i] != i)
+			return false;
+	return true;
+}
+
+void PointOpsStage::Read(boost::property_tree::ptree const &params)
+{
+	pool_ = std::make_unique<RowBandPool>(params.get<unsigned int>("threads", 2));
+
+	boost::property_tree::ptree empty;
+	y_kernel_.lut = compose_ops(params.get_child("y", empty));
+	uv_kernel_.lut_u = compose_ops(params.get_child("u", empty));
+	uv_kernel_.lut_v = compose_ops(params.get_child("v", empty));
+
+	// A saturation gain is just a diagonal matrix, and hue is a rotation. If a full matrix
+	// is given as well, it gets applied after these.
+	double saturation = params.get<double>("saturation", 1.0);
+	double hue = params.get<double>("hue", 0.0) * M_PI / 180;
+	std::array<double, 4> m = { saturation * cos(hue), -saturation * sin(hue), saturation * sin(hue),
+								saturation * cos(hue) };
+	if (params.count("uv_matrix"))
+	{
+		std::vector<double> user;
+		for (auto const &[unused, value] : params.get_child("uv_matrix"))
+			user.push_back(value.get_value<double>());
+		if (user.size() != 4)
+			throw std::runtime_error("PointOpsStage: uv_matrix must have 4 entries");
+		m = { user[0] * m[0] + user[1] * m[2], user[0] * m[1] + user[1] * m[3], user[2] * m[0] + user[3] * m[2],
+			  user[2] * m[1] + user[3] * m[3] };
+	}
+	for (unsigned int i = 0; i < 4; i++)
+		uv_kernel_.matrix[i] = std::lround(m[i] * (1 << ChromaMatrixKernel::Shift));
+
+	y_identity_ = is_identity(y_kernel_.lut);
+	u_identity_ = is_identity(uv_kernel_.lut_u);
+	v_identity_ = is_identity(uv_kernel_.lut_v);
+	constexpr int one = 1 << ChromaMatrixKernel::Shift;
+	matrix_identity_ = uv_kernel_.matrix == std::array<int, 4> { one, 0, 0, one };
+}
+
+void PointOpsStage::Configure()
+{
+	stream_ = app_->GetMainStream();
+	if (!stream_ || stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("PointOpsStage: only YUV420 format supported");
+	info_ = app_->GetStreamInfo(stream_);
+}
+
+bool PointOpsStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (y_identity_ && u_identity_ && v_identity_ && matrix_identity_)
+		return false;
+
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	uint8_t *y_plane = buffer.data();
+	uint8_t *u_plane = y_plane + info_.stride * info_.height;
+	uint8_t *v_plane = u_plane + (info_.stride / 2) * (info_.height / 2);
+	unsigned int width2 = info_.width / 2, height2 = info_.height / 2, stride2 = info_.stride / 2;
+
+	if (!y_identity_)
+		ApplyKernel(y_kernel_, y_plane, info_.width, info_.height, info_.stride, *pool_);
+
+	if (!matrix_identity_)
+		ApplyKernel(uv_kernel_, u_plane, v_plane, width2, height2, stride2, *pool_);
+	else
+	{
+		if (!u_identity_)
+			ApplyKernel(LutKernel { uv_kernel_.lut_u }, u_plane, width2, height2, stride2, *pool_);
+		if (!v_identity_)
+			ApplyKernel(LutKernel { uv_kernel_.lut_v }, v_plane, width2, height2, stride2, *pool_);
+	}
+
+	return false;
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new PointOpsStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -7,6 +7,10 @@
 
 #include "post_processing_stage.hpp"
 
+#include "core/libcamera_app.hpp"
+
+#include "post_processing_stages/image_cache.hpp"
+
 PostProcessingStage::PostProcessingStage(LibcameraApp *app) : app_(app)
 {
 }
@@ -41,6 +45,19 @@ void PostProcessingStage::Teardown()
 {
 }
 
+std::shared_ptr<ImageCache> PostProcessingStage::GetImageCache(CompletedRequestPtr &completed_request,
+															   libcamera::Stream *stream)
+{
+	std::shared_ptr<ImageCache> &cache = completed_request->image_cache[stream];
+	if (!cache)
+	{
+		BufferReadSync r(app_, completed_request->buffers[stream]);
+		cache = std::make_shared<ImageCache>(r.Get()[0], app_->GetStreamInfo(stream));
+	}
+
+	return cache;
+}
+
 std::vector<uint8_t> PostProcessingStage::Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info)
 {
 	std::vector<uint8_t> output(dst_info.height * dst_info.stride);
@@ -20,9 +20,11 @@
 
 namespace libcamera
 {
+class Stream;
 struct StreamConfiguration;
 }
 
+class ImageCache;
 class LibcameraApp;
 
 using StreamConfiguration = libcamera::StreamConfiguration;
@@ -58,6 +60,11 @@ public:
 	static std::vector<uint8_t> Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
 
 protected:
+	// Return the cache of images derived from this (YUV420) stream of the request, copying the
+	// image out of the camera buffer if no other stage has done so yet. Stages should prefer
+	// this to reading and converting the buffer themselves.
+	std::shared_ptr<ImageCache> GetImageCache(CompletedRequestPtr &completed_request, libcamera::Stream *stream);
+
 	// Helper to calculate the execution time of any callable object and return it in as a std::chrono::duration.
 	// For functions returning a value, the simplest thing would be to wrap the call in a lambda and capture
 	// the return value.
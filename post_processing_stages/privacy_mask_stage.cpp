@@ -0,0 +1,307 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * privacy_mask_stage.cpp - blur, pixelate or blank regions of the image
+ */
+
+// Hides regions of the main image, which must be YUV420. The regions can be fixed
+// rectangles from the JSON file (given as fractions of the image size), and/or the faces
+// and objects found by earlier stages ("detected_faces" and "object_detect.results", so
+// list those stages first). Detection boxes can be enlarged by a margin, which helps cover
+// things that have moved since the detector last ran.
+//
+// Only the masked regions are touched, so the cost depends on how much of the image is
+// masked and not on the image size. Blurring uses a separable box filter with running sums,
+// so it costs the same whatever the radius is.
+
+#include <algorithm>
+
+#include <libcamera/formats.h>
+#include <libcamera/geometry.h>
+#include <libcamera/stream.h>
+
+#include "core/libcamera_app.hpp"
+
+#include "post_processing_stages/object_detect.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Rectangle = libcamera::Rectangle;
+using Stream = libcamera::Stream;
+
+class PrivacyMaskStage : public PostProcessingStage
+{
+public:
+	PrivacyMaskStage(LibcameraApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	enum class Mode
+	{
+		Blur,
+		Pixelate,
+		Fill
+	};
+
+	void mask(uint8_t *plane, unsigned int stride, Rectangle const &r, unsigned int scale, uint8_t fill_value);
+
+	Stream *stream_;
+	StreamInfo info_;
+	Mode mode_;
+	unsigned int blur_radius_;
+	unsigned int blur_passes_;
+	unsigned int block_size_;
+	uint8_t fill_y_;
+	std::vector<libcamera::Rectangle> rectangles_; // in pixels, once configured
+	std::vector<std::array<float, 4>> rectangle_fractions_;
+	bool mask_faces_;
+	std::vector<std::string> object_names_; // empty means all objects
+	bool mask_objects_;
+	float confidence_;
+	float margin_;
+};
+
+#define NAME "privacy_mask"
+
+char const *PrivacyMaskStage::Name() const
+{
+	return NAME;
+}
+
+void PrivacyMaskStage::Read(boost::property_tree::ptree const &params)
+{
+	std::string mode = params.get<std::string>("mode", "blur");
+	if (mode == "blur")
+		mode_ = Mode::Blur;
+	else if (mode == "pixelate")
+		mode_ = Mode::Pixelate;
+	else if (mode == "fill")
+		mode_ = Mode::Fill;
+	else
+		throw std::runtime_error("PrivacyMaskStage: unknown mode " + mode);
+
+	blur_radius_ = params.get<unsigned int>("blur_radius", 16);
+	blur_passes_ = params.get<unsigned int>("blur_passes", 2);
+	block_size_ = params.get<unsigned int>("block_size", 32);
+	unsigned int fill_y = params.get<unsigned int>("fill_y", 16);
+	if (blur_radius_ < 1 || blur_radius_ > 127)
+		throw std::runtime_error("PrivacyMaskStage: blur_radius must be from 1 to 127");
+	// No passes at all would leave the masked regions untouched.
+	if (blur_passes_ < 1)
+		throw std::runtime_error("PrivacyMaskStage: blur_passes must be at least 1");
+	if (block_size_ < 2)
+		throw std::runtime_error("PrivacyMaskStage: block_size must be at least 2");
+	if (fill_y > 255)
+		throw std::runtime_error("PrivacyMaskStage: fill_y must be from 0 to 255");
+	fill_y_ = fill_y;
+
+	if (params.count("rectangles"))
+	{
+		for (auto const &[unused, rect] : params.get_child("rectangles"))
+		{
+			std::vector<float> values;
+			for (auto const &[unused2, value] : rect)
+				values.push_back(value.get_value<float>());
+			if (values.size() != 4)
+				throw std::runtime_error("PrivacyMaskStage: rectangles need x, y, width and height");
+			// Rectangles are fractions of the image, so anything outside 0 to 1 is a mistake.
+			for (float value : values)
+			{
+				if (value < 0 || value > 1)
+					throw std::runtime_error("PrivacyMaskStage: rectangle values must be from 0 to 1");
+			}
+			rectangle_fractions_.push_back({ values[0], values[1], values[2], values[3] });
+		}
+	}
+
+	mask_faces_ = params.get<int>("faces", 0);
+	mask_objects_ = params.count("objects");
+	if (mask_objects_)
+	{
+		for (auto const &[unused, name] : params.get_child("objects"))
+			object_names_.push_back(name.get_value<std::string>());
+	}
+	confidence_ = params.get<float>("confidence_threshold", 0.5);
+	margin_ = params.get<float>("margin", 0.1);
+}
+
+void PrivacyMaskStage::Configure()
+{
+	stream_ = app_->GetMainStream();
+	if (!stream_ || stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("PrivacyMaskStage: only YUV420 format supported");
+	info_ = app_->GetStreamInfo(stream_);
+
+	rectangles_.clear();
+	for (auto const &f : rectangle_fractions_)
+		rectangles_.emplace_back(f[0] * info_.width, f[1] * info_.height, f[2] * info_.width, f[3] * info_.height);
+}
+
+// Blur a rectangle of a plane in place. Pixels beyond the edges of the rectangle are
+// treated as copies of the edge pixels, so nothing from outside leaks in.
+static void box_blur(uint8_t *plane, unsigned int stride, Rectangle const &r, int radius,
+					 std::vector<uint16_t> &row_sums, std::vector<uint32_t> &col_sums)
+{
+	int w = r.width, h = r.height;
+	int n = 2 * radius + 1;
+	// Dividing by n * n with a 16-bit reciprocal is plenty accurate enough here.
+	uint32_t inv = (65536 + n * n / 2) / (n * n);
+	auto clip = [](int v, int max) { return std::clamp(v, 0, max - 1); };
+
+	// Horizontal running sums of each row.
+	row_sums.resize(w * h);
+	for (int y = 0; y < h; y++)
+	{
+		const uint8_t *src = plane + (r.y + y) * stride + r.x;
+		uint16_t *dst = &row_sums[y * w];
+		unsigned int sum = 0;
+		for (int x = -radius; x <= radius; x++)
+			sum += src[clip(x, w)];
+		for (int x = 0; x < w; x++)
+		{
+			dst[x] = sum;
+			sum += src[clip(x + radius + 1, w)] - src[clip(x - radius, w)];
+		}
+	}
+
+	// Vertical running sums, updated a whole row at a time.
+	col_sums.assign(w, 0);
+	for (int y = -radius; y <= radius; y++)
+	{
+		const uint16_t *src = &row_sums[clip(y, h) * w];
+		for (int x = 0; x < w; x++)
+			col_sums[x] += src[x];
+	}
+	for (int y = 0; y < h; y++)
+	{
+		uint8_t *dst = plane + (r.y + y) * stride + r.x;
+		for (int x = 0; x < w; x++)
+			dst[x] = (col_sums[x] * inv + 32768) >> 16;
+		const uint16_t *add = &row_sums[clip(y + radius + 1, h) * w];
+		const uint16_t *sub = &row_sums[clip(y - radius, h) * w];
+		for (int x = 0; x < w; x++)
+			col_sums[x] += add[x] - sub[x];
+	}
+}
+
+static void pixelate(uint8_t *plane, unsigned int stride, Rectangle const &r, unsigned int block)
+{
+	for (unsigned int by = 0; by < r.height; by += block)
+	{
+		unsigned int bh = std::min(block, r.height - by);
+		for (unsigned int bx = 0; bx < r.width; bx += block)
+		{
+			unsigned int bw = std::min(block, r.width - bx);
+			uint8_t *ptr = plane + (r.y + by) * stride + r.x + bx;
+			unsigned int sum = 0;
+			for (unsigned int y = 0; y < bh; y++)
+				for (unsigned int x = 0; x < bw; x++)
+					sum += ptr[y * stride + x];
+			uint8_t average = (sum + bw * bh / 2) / (bw * bh);
+			for (unsigned int y = 0; y < bh; y++)
+				std::fill_n(ptr + y * stride, bw, average);
+		}
+	}
+}
+
+// Mask the rectangle (given in luma pixels) on a plane that is subsampled by this scale.
+void PrivacyMaskStage::mask(uint8_t *plane, unsigned int stride, Rectangle const &r, unsigned int scale,
+							uint8_t fill_value)
+{
+	Rectangle rect(r.x / scale, r.y / scale, r.width / scale, r.height / scale);
+	if (rect.isNull())
+		return;
+
+	if (mode_ == Mode::Blur)
+	{
+		// These get reused for every pass.
+		std::vector<uint16_t> row_sums;
+		std::vector<uint32_t> col_sums;
+		int radius = std::max(blur_radius_ / scale, 1u);
+		for (unsigned int i = 0; i < blur_passes_; i++)
+			box_blur(plane, stride, rect, radius, row_sums, col_sums);
+	}
+	else if (mode_ == Mode::Pixelate)
+		pixelate(plane, stride, rect, std::max(block_size_ / scale, 1u));
+	else
+	{
+		for (unsigned int y = 0; y < rect.height; y++)
+			std::fill_n(plane + (rect.y + y) * stride + rect.x, rect.width, fill_value);
+	}
+}
+
+bool PrivacyMaskStage::Process(CompletedRequestPtr &completed_request)
+{
+	std::vector<Rectangle> regions = rectangles_;
+
+	auto add_detection = [this, &regions](Rectangle const &box) {
+		int dx = box.width * margin_, dy = box.height * margin_;
+		regions.emplace_back(box.x - dx, box.y - dy, box.width + 2 * dx, box.height + 2 * dy);
+	};
+
+	if (mask_faces_)
+	{
+		std::vector<Rectangle> faces;
+		if (completed_request->post_process_metadata.Get("detected_faces", faces) == 0)
+			std::for_each(faces.begin(), faces.end(), add_detection);
+	}
+
+	if (mask_objects_)
+	{
+		std::vector<Detection> detections;
+		if (completed_request->post_process_metadata.Get("object_detect.results", detections) == 0)
+		{
+			for (auto const &detection : detections)
+			{
+				if (detection.confidence < confidence_)
+					continue;
+				if (object_names_.empty() ||
+					std::find(object_names_.begin(), object_names_.end(), detection.name) != object_names_.end())
+					add_detection(detection.box);
+			}
+		}
+	}
+
+	if (regions.empty())
+		return false;
+
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	uint8_t *y_plane = buffer.data();
+	uint8_t *u_plane = y_plane + info_.stride * info_.height;
+	uint8_t *v_plane = u_plane + (info_.stride / 2) * (info_.height / 2);
+	Rectangle image(0, 0, info_.width, info_.height);
+
+	for (auto const &region : regions)
+	{
+		// Clip to the image, and round outwards to even coordinates so that the chroma
+		// covers exactly the same area.
+		Rectangle r = region.boundedTo(image);
+		if (r.isNull())
+			continue;
+		int x0 = r.x & ~1, y0 = r.y & ~1;
+		int x1 = std::min<int>((r.x + r.width + 1) & ~1, info_.width & ~1);
+		int y1 = std::min<int>((r.y + r.height + 1) & ~1, info_.height & ~1);
+		r = Rectangle(x0, y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0));
+
+		mask(y_plane, info_.stride, r, 1, fill_y_);
+		mask(u_plane, info_.stride / 2, r, 2, 128);
+		mask(v_plane, info_.stride / 2, r, 2, 128);
+	}
+
+	return false;
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new PrivacyMaskStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
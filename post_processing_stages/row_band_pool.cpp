@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * row_band_pool.cpp - split work on an image into bands of rows over a pool of threads
+ */
+
+#include <algorithm>
+
+#include "post_processing_stages/row_band_pool.hpp"
+
+RowBandPool::RowBandPool(unsigned int threads)
+	: threads_(std::max(threads, 1u)), job_(nullptr), height_(0), bands_(0), pending_(0), generation_(0),
+	  abort_(false)
+{
+	for (unsigned int i = 0; i < threads_ - 1; i++)
+		workers_.emplace_back(&RowBandPool::workerThread, this, i);
+}
+
+RowBandPool::~RowBandPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	work_cond_var_.notify_all();
+	for (auto &w : workers_)
+		w.join();
+}
+
+void RowBandPool::Run(unsigned int height, BandFunction const &f)
+{
+	unsigned int bands = std::clamp(threads_, 1u, std::max(height, 1u));
+	std::unique_lock<std::mutex> run_lock(run_mutex_, std::try_to_lock);
+	if (bands == 1 || !run_lock)
+	{
+		f(0, height);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		job_ = &f;
+		height_ = height;
+		bands_ = bands;
+		pending_ = bands - 1;
+		generation_++;
+	}
+	work_cond_var_.notify_all();
+
+	f((bands - 1) * height / bands, height);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	done_cond_var_.wait(lock, [this] { return pending_ == 0; });
+	job_ = nullptr;
+}
+
+void RowBandPool::workerThread(unsigned int index)
+{
+	uint64_t generation = 0;
+	while (true)
+	{
+		BandFunction const *job;
+		unsigned int y0, y1;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			work_cond_var_.wait(lock, [this, generation] { return abort_ || generation_ != generation; });
+			if (abort_)
+				return;
+			generation = generation_;
+			// Short images may not need every worker.
+			if (index >= bands_ - 1)
+				continue;
+			job = job_;
+			y0 = index * height_ / bands_;
+			y1 = (index + 1) * height_ / bands_;
+		}
+
+		(*job)(y0, y1);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (--pending_ == 0)
+			done_cond_var_.notify_one();
+	}
+}
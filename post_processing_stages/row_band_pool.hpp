@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * row_band_pool.hpp - split work on an image into bands of rows over a pool of threads
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The worker threads live as long as the pool (normally the life of a stage), so that
+// splitting every frame into bands doesn't mean creating and joining threads each time.
+// The calling thread does the last band itself. If the pool is already busy with another
+// frame, as stages may be called from several threads at once, the caller simply does all
+// the rows on its own.
+class RowBandPool
+{
+public:
+	typedef std::function<void(unsigned int y0, unsigned int y1)> BandFunction;
+
+	RowBandPool(unsigned int threads);
+	~RowBandPool();
+
+	// Call f(y0, y1) for bands of rows that together cover [0, height), returning when
+	// they are all done.
+	void Run(unsigned int height, BandFunction const &f);
+
+private:
+	void workerThread(unsigned int index);
+
+	unsigned int threads_;
+	std::mutex run_mutex_;
+	std::mutex mutex_;
+	std::condition_variable work_cond_var_;
+	std::condition_variable done_cond_var_;
+	BandFunction const *job_;
+	unsigned int height_;
+	unsigned int bands_;
+	unsigned int pending_;
+	uint64_t generation_;
+	bool abort_;
+	std::vector<std::thread> workers_;
+};
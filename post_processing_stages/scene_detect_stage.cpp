@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * scene_detect_stage.cpp - scene change detector
+ */
+
+// Spots sudden changes in the scene, such as cuts or lights being switched on, and asks
+// the video encoder to start a new GOP there. Otherwise the first frame after the change
+// would have to be coded as a very large P frame, which, at a fixed bitrate, ruins the
+// quality for some time afterwards.
+//
+// We compare each low resolution frame against the previous one in two ways: the
+// difference between their luma histograms (which catches lighting changes), and the mean
+// absolute difference between small thumbnails of them (which catches cuts between scenes
+// with similar histograms). If either exceeds its threshold, the stage sets
+// "scene_detect.keyframe" to true in the request's post-processing metadata, which the
+// encoder picks up. A minimum interval between keyframes stops a sustained disturbance
+// from producing a burst of them.
+
+#include <array>
+#include <mutex>
+
+#include <libcamera/stream.h>
+
+#include "core/libcamera_app.hpp"
+
+#include "post_processing_stages/image_cache.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+class SceneDetectStage : public PostProcessingStage
+{
+public:
+	SceneDetectStage(LibcameraApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	static constexpr unsigned int HISTOGRAM_BINS = 32;
+
+	Stream *stream_;
+	unsigned int thumbnail_level_;
+	float histogram_threshold_;
+	float difference_threshold_;
+	unsigned int min_interval_;
+	bool verbose_;
+
+	std::mutex mutex_;
+	bool first_time_;
+	unsigned int last_sequence_;
+	unsigned int last_keyframe_;
+	std::array<uint32_t, HISTOGRAM_BINS> last_histogram_;
+	std::shared_ptr<const LumaImage> last_thumbnail_;
+};
+
+#define NAME "scene_detect"
+
+char const *SceneDetectStage::Name() const
+{
+	return NAME;
+}
+
+void SceneDetectStage::Read(boost::property_tree::ptree const &params)
+{
+	histogram_threshold_ = params.get<float>("histogram_threshold", 0.4);
+	difference_threshold_ = params.get<float>("difference_threshold", 0.15);
+	min_interval_ = params.get<unsigned int>("min_interval", 15);
+	verbose_ = params.get<int>("verbose", 0);
+}
+
+void SceneDetectStage::Configure()
+{
+	StreamInfo info;
+	stream_ = app_->LoresStream(&info);
+	if (!stream_)
+		return;
+
+	// Thumbnails of around 64 pixels across are plenty for spotting cuts.
+	thumbnail_level_ = 0;
+	while ((info.width >> (thumbnail_level_ + 1)) >= 64 && (info.height >> (thumbnail_level_ + 1)) >= 16)
+		thumbnail_level_++;
+	first_time_ = true;
+}
+
+bool SceneDetectStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	std::shared_ptr<ImageCache> cache = GetImageCache(completed_request, stream_);
+	std::shared_ptr<const LumaImage> luma = cache->Luma(0);
+	std::shared_ptr<const LumaImage> thumbnail = cache->Luma(thumbnail_level_);
+
+	std::array<uint32_t, HISTOGRAM_BINS> histogram = {};
+	for (unsigned int i = 0; i < luma->data.size(); i += 2)
+		histogram[luma->data[i] * HISTOGRAM_BINS / 256]++;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// Requests may be processed in parallel; comparing with a later frame makes no sense.
+	if (!first_time_ && completed_request->sequence <= last_sequence_)
+		return false;
+
+	if (!first_time_)
+	{
+		// Both measures are normalised to the range 0 to 1.
+		uint32_t histogram_total = 0, histogram_diff = 0;
+		for (unsigned int i = 0; i < HISTOGRAM_BINS; i++)
+		{
+			histogram_total += histogram[i];
+			histogram_diff += std::abs((int)histogram[i] - (int)last_histogram_[i]);
+		}
+		float histogram_score = histogram_diff / (2.0f * histogram_total);
+
+		uint32_t pixel_diff = 0;
+		for (unsigned int i = 0; i < thumbnail->data.size(); i++)
+			pixel_diff += std::abs(thumbnail->data[i] - last_thumbnail_->data[i]);
+		float difference_score = pixel_diff / (255.0f * thumbnail->data.size());
+
+		bool change = histogram_score > histogram_threshold_ || difference_score > difference_threshold_;
+		if (change && completed_request->sequence >= last_keyframe_ + min_interval_)
+		{
+			completed_request->post_process_metadata.Set("scene_detect.keyframe", true);
+			last_keyframe_ = completed_request->sequence;
+			if (verbose_)
+				LOG(1, "SceneDetectStage: scene change at frame " << completed_request->sequence << " (histogram "
+																  << histogram_score << " difference "
+																  << difference_score << ")");
+		}
+	}
+	else
+		last_keyframe_ = completed_request->sequence;
+
+	first_time_ = false;
+	last_sequence_ = completed_request->sequence;
+	last_histogram_ = histogram;
+	last_thumbnail_ = thumbnail;
+
+	return false;
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new SceneDetectStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -0,0 +1,262 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * stabilise_stage.cpp - digital image stabilisation
+ */
+
+// A simple digital image stabiliser. It zooms in very slightly (by "margin", a fraction of
+// the image size) using the ScalerCrop control, and then moves the crop window around to
+// follow the camera shake, so that the shake disappears from the output images. Because
+// the crop is done by the ISP, no extra passes over the full resolution image are needed.
+//
+// The global translation between frames is estimated from the low resolution stream (so
+// one must be configured) using projection profiles: the image's row and column sums are
+// compared with those of the previous frame at a range of offsets, and the best match
+// gives the translation in each direction. The cumulative motion is then low pass filtered
+// to give a smooth trajectory, which slow deliberate camera movements will follow, and the
+// difference between the two is the shake that we correct.
+//
+// Crop changes take a few frames to apply, but the ScalerCrop in each frame's metadata tells
+// us the crop that was really used, so this is accounted for when estimating the motion.
+
+#include <cmath>
+#include <mutex>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/geometry.h>
+#include <libcamera/stream.h>
+
+#include "core/libcamera_app.hpp"
+
+#include "post_processing_stages/image_cache.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Rectangle = libcamera::Rectangle;
+using Stream = libcamera::Stream;
+
+class StabiliseStage : public PostProcessingStage
+{
+public:
+	StabiliseStage(LibcameraApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	struct Profiles
+	{
+		std::vector<int> rows;
+		std::vector<int> cols;
+	};
+
+	void calculateProfiles(const uint8_t *image, Profiles &profiles);
+	void update(Profiles const &profiles, Rectangle const &crop, unsigned int sequence);
+
+	Stream *stream_;
+	StreamInfo info_;
+	float margin_;
+	int max_shift_;
+	float smoothing_;
+	bool verbose_;
+
+	std::mutex mutex_;
+	bool warned_;
+	bool first_time_;
+	unsigned int last_sequence_;
+	Profiles last_profiles_;
+	Rectangle last_crop_;
+	// The unzoomed crop we found when we started, and the zoomed crop we move around.
+	Rectangle full_crop_;
+	Rectangle base_crop_;
+	// Cumulative motion of the image content (in sensor pixels), and its smoothed version.
+	double position_x_, position_y_;
+	double smoothed_x_, smoothed_y_;
+};
+
+#define NAME "stabilise"
+
+char const *StabiliseStage::Name() const
+{
+	return NAME;
+}
+
+void StabiliseStage::Read(boost::property_tree::ptree const &params)
+{
+	margin_ = params.get<float>("margin", 0.1);
+	max_shift_ = params.get<int>("max_shift", 16);
+	smoothing_ = params.get<float>("smoothing", 0.9);
+	verbose_ = params.get<int>("verbose", 0);
+
+	if (margin_ <= 0 || margin_ >= 0.5)
+		throw std::runtime_error("StabiliseStage: margin must be between 0 and 0.5");
+	if (smoothing_ < 0 || smoothing_ >= 1)
+		throw std::runtime_error("StabiliseStage: smoothing must be from 0 to less than 1");
+}
+
+void StabiliseStage::Configure()
+{
+	stream_ = app_->LoresStream(&info_);
+	if (!stream_)
+		return;
+
+	max_shift_ = std::clamp<int>(max_shift_, 1, std::min(info_.width, info_.height) / 4);
+	first_time_ = true;
+	warned_ = false;
+}
+
+void StabiliseStage::calculateProfiles(const uint8_t *image, Profiles &profiles)
+{
+	profiles.rows.resize(info_.height);
+	profiles.cols.assign(info_.width, 0);
+	for (unsigned int y = 0; y < info_.height; y++)
+	{
+		const uint8_t *row = image + y * info_.stride;
+		int row_sum = 0;
+		for (unsigned int x = 0; x < info_.width; x++)
+		{
+			row_sum += row[x];
+			profiles.cols[x] += row[x];
+		}
+		profiles.rows[y] = row_sum;
+	}
+
+	// Remove the mean so that exposure changes don't upset the matching.
+	for (auto *profile : { &profiles.rows, &profiles.cols })
+	{
+		int64_t total = 0;
+		for (int v : *profile)
+			total += v;
+		int mean = total / (int64_t)profile->size();
+		for (int &v : *profile)
+			v -= mean;
+	}
+}
+
+// Find the shift that best maps the previous profile onto the current one, to sub-pixel
+// precision. A positive value means the image content moved right (or down).
+static double match_profiles(std::vector<int> const &prev, std::vector<int> const &cur, int max_shift)
+{
+	int n = cur.size();
+	std::vector<double> costs(2 * max_shift + 1);
+	for (int shift = -max_shift; shift <= max_shift; shift++)
+	{
+		int start = std::max(0, shift), end = std::min(n, n + shift);
+		int64_t sad = 0;
+		for (int i = start; i < end; i++)
+			sad += std::abs(cur[i] - prev[i - shift]);
+		costs[shift + max_shift] = (double)sad / (end - start);
+	}
+
+	int best = std::min_element(costs.begin(), costs.end()) - costs.begin();
+	double offset = 0;
+	if (best > 0 && best < 2 * max_shift)
+	{
+		// Fit a parabola through the minimum and its neighbours.
+		double c0 = costs[best - 1], c1 = costs[best], c2 = costs[best + 1];
+		double denom = c0 - 2 * c1 + c2;
+		if (denom > 0)
+			offset = 0.5 * (c0 - c2) / denom;
+	}
+	return best - max_shift + offset;
+}
+
+void StabiliseStage::update(Profiles const &profiles, Rectangle const &crop, unsigned int sequence)
+{
+	if (first_time_)
+	{
+		full_crop_ = crop;
+		unsigned int w = crop.width * (1 - margin_), h = crop.height * (1 - margin_);
+		base_crop_ = Rectangle(crop.x + (crop.width - w) / 2, crop.y + (crop.height - h) / 2, w, h);
+		position_x_ = position_y_ = smoothed_x_ = smoothed_y_ = 0;
+		first_time_ = false;
+	}
+	else
+	{
+		// The lores image shows whatever is in the crop, so the measured motion is in units of
+		// lores pixels and includes any movement of the crop's centre. When the crop changes
+		// size (as when we first zoom in to base_crop_) the two images are at different scales
+		// and matching them tells us nothing, so we assume no motion.
+		double dx = 0, dy = 0;
+		if (crop.width == last_crop_.width && crop.height == last_crop_.height)
+		{
+			double scale_x = (double)crop.width / info_.width, scale_y = (double)crop.height / info_.height;
+			dx = match_profiles(last_profiles_.cols, profiles.cols, max_shift_) * scale_x +
+				 (crop.x + crop.width / 2.0) - (last_crop_.x + last_crop_.width / 2.0);
+			dy = match_profiles(last_profiles_.rows, profiles.rows, max_shift_) * scale_y +
+				 (crop.y + crop.height / 2.0) - (last_crop_.y + last_crop_.height / 2.0);
+		}
+		position_x_ += dx;
+		position_y_ += dy;
+		smoothed_x_ = smoothing_ * smoothed_x_ + (1 - smoothing_) * position_x_;
+		smoothed_y_ = smoothing_ * smoothed_y_ + (1 - smoothing_) * position_y_;
+
+		// Move the crop with the shake, as far as the margin allows. If we hit the limit, pull
+		// the smoothed trajectory along so that we don't stay stuck against it.
+		double max_x = (full_crop_.width - base_crop_.width) / 2.0;
+		double max_y = (full_crop_.height - base_crop_.height) / 2.0;
+		double correction_x = std::clamp(position_x_ - smoothed_x_, -max_x, max_x);
+		double correction_y = std::clamp(position_y_ - smoothed_y_, -max_y, max_y);
+		smoothed_x_ = position_x_ - correction_x;
+		smoothed_y_ = position_y_ - correction_y;
+
+		Rectangle new_crop = base_crop_;
+		new_crop.x += std::lround(correction_x);
+		new_crop.y += std::lround(correction_y);
+		libcamera::ControlList controls;
+		controls.set(libcamera::controls::ScalerCrop, new_crop);
+		app_->SetControls(controls);
+
+		if (verbose_)
+			LOG(1, "StabiliseStage: motion " << dx << "," << dy << " correction " << correction_x << ","
+											 << correction_y);
+	}
+
+	last_profiles_ = profiles;
+	last_crop_ = crop;
+	last_sequence_ = sequence;
+}
+
+bool StabiliseStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	auto crop = completed_request->metadata.get(libcamera::controls::ScalerCrop);
+	if (!crop)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!warned_)
+			LOG_ERROR("WARNING: StabiliseStage: no ScalerCrop in metadata, unable to stabilise");
+		warned_ = true;
+		return false;
+	}
+
+	std::shared_ptr<const std::vector<uint8_t>> yuv420 = GetImageCache(completed_request, stream_)->Yuv420();
+	Profiles profiles;
+	auto time_taken = ExecutionTime<std::micro>([&]() {
+		calculateProfiles(yuv420->data(), profiles);
+		std::lock_guard<std::mutex> lock(mutex_);
+		// Requests can be processed in parallel. Comparing against a later frame would make
+		// no sense, so just drop anything that arrives out of order.
+		if (first_time_ || completed_request->sequence > last_sequence_)
+			update(profiles, *crop, completed_request->sequence);
+	}).count();
+
+	if (verbose_)
+		LOG(1, "StabiliseStage: took " << time_taken << "us");
+
+	return false;
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new StabiliseStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * temporal_denoise_stage.cpp - motion-adaptive temporal noise reduction
+ */
+
+// A recursive temporal filter for the main image. Each output pixel is a blend of the new
+// pixel and the previous output, which we keep in a reference image in cached memory. Where
+// the difference between the two is small it's assumed to be noise and the reference gets
+// most of the weight. Large differences are assumed to be motion, and there the new pixel
+// gets more of the weight, reaching all of it for differences above the "high" threshold,
+// so that moving objects don't leave trails behind them.
+//
+// All the arithmetic is in 8-bit fixed point so that the compiler can vectorise it, and the
+// image is split into bands of rows that are filtered in parallel. The filtered image is
+// written back into the request's buffer, so it is what gets displayed and encoded.
+
+// The post-processing framework may run several requests at once, so it's possible that
+// frames occasionally get filtered out of order. As with the motion detector, this is rare
+// and harmless.
+
+#include <cmath>
+#include <memory>
+#include <mutex>
+
+#include <libcamera/formats.h>
+#include <libcamera/stream.h>
+
+#include "core/libcamera_app.hpp"
+
+#include "post_processing_stages/pixel_kernel.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+#include "post_processing_stages/temporal_filter.hpp"
+
+using Stream = libcamera::Stream;
+
+class TemporalDenoiseStage : public PostProcessingStage
+{
+public:
+	TemporalDenoiseStage(LibcameraApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	void filter(uint8_t *image);
+
+	Stream *stream_;
+	StreamInfo info_;
+	std::unique_ptr<RowBandPool> pool_;
+	bool verbose_;
+	TemporalFilterKernel y_kernel_;
+	TemporalFilterKernel uv_kernel_;
+	std::vector<uint8_t> reference_;
+	bool first_time_;
+	double total_time_;
+	unsigned int frames_;
+	std::mutex mutex_;
+};
+
+#define NAME "temporal_denoise"
+
+char const *TemporalDenoiseStage::Name() const
+{
+	return NAME;
+}
+
+static TemporalFilterKernel make_kernel(double strength, int low, int high)
+{
+	if (strength < 0 || strength > 1)
+		throw std::runtime_error("TemporalDenoiseStage: strength must be between 0 and 1");
+	if (high <= low)
+		throw std::runtime_error("TemporalDenoiseStage: motion thresholds must have high > low");
+
+	return TemporalFilterKernel::Create(strength, low, high);
+}
+
+void TemporalDenoiseStage::Read(boost::property_tree::ptree const &params)
+{
+	pool_ = std::make_unique<RowBandPool>(params.get<unsigned int>("threads", 2));
+	verbose_ = params.get<int>("verbose", 0);
+	y_kernel_ = make_kernel(params.get<double>("strength", 0.75), params.get<int>("motion_low", 4),
+							params.get<int>("motion_high", 16));
+	uv_kernel_ = make_kernel(params.get<double>("uv_strength", 0.85), params.get<int>("uv_motion_low", 3),
+							 params.get<int>("uv_motion_high", 12));
+}
+
+void TemporalDenoiseStage::Configure()
+{
+	stream_ = app_->GetMainStream();
+	if (!stream_ || stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("TemporalDenoiseStage: only YUV420 format supported");
+	info_ = app_->GetStreamInfo(stream_);
+
+	// The reference has exactly the same layout as the image, so rows line up.
+	reference_.resize(info_.stride * info_.height + 2 * (info_.stride / 2) * (info_.height / 2));
+	first_time_ = true;
+	total_time_ = 0;
+	frames_ = 0;
+}
+
+void TemporalDenoiseStage::filter(uint8_t *image)
+{
+	uint8_t *ref = reference_.data();
+	ApplyKernel(y_kernel_, image, ref, info_.width, info_.height, info_.stride, *pool_);
+
+	// The U and V planes follow one another with the same stride, so we can do them together.
+	size_t y_size = info_.stride * info_.height;
+	ApplyKernel(uv_kernel_, image + y_size, ref + y_size, info_.width / 2, 2 * (info_.height / 2),
+				info_.stride / 2, *pool_);
+}
+
+bool TemporalDenoiseStage::Process(CompletedRequestPtr &completed_request)
+{
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	if (buffer.size() < reference_.size())
+		throw std::runtime_error("TemporalDenoiseStage: buffer too small");
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (first_time_)
+	{
+		std::copy_n(buffer.data(), reference_.size(), reference_.begin());
+		first_time_ = false;
+		return false;
+	}
+
+	auto time_taken = ExecutionTime<std::micro>(&TemporalDenoiseStage::filter, this, buffer.data()).count();
+
+	if (verbose_)
+	{
+		total_time_ += time_taken;
+		frames_++;
+		LOG(1, "TemporalDenoiseStage: filtered in " << time_taken << "us (average " << total_time_ / frames_
+													<< "us)");
+	}
+
+	return false;
+}
+
+static PostProcessingStage *Create(LibcameraApp *app)
+{
+	return new TemporalDenoiseStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
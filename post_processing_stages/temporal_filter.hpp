@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2023, Raspberry Pi Ltd
+ *
+ * temporal_filter.hpp - motion-adaptive temporal filter kernel
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+// Blend a row of new pixels with the reference. The output is written back to both. This is
+// shared by the temporal_denoise stage and the denoise-bitrate measurement tool.
+struct TemporalFilterKernel
+{
+	// Blend weight (out of 256) for the new pixel when the difference is below low.
+	int min_alpha;
+	int low;
+	// Increase in alpha per level of difference above low, with 8 fractional bits.
+	int slope;
+
+	// strength in [0, 1] is how much of the reference is kept for small differences, which
+	// fades to none of it at a difference of high. The caller checks that high > low.
+	static TemporalFilterKernel Create(double strength, int low, int high)
+	{
+		TemporalFilterKernel kernel;
+		kernel.min_alpha = std::lround((1 - strength) * 256);
+		kernel.low = low;
+		kernel.slope = ((256 - kernel.min_alpha) << 8) / (high - low);
+		return kernel;
+	}
+
+	void operator()(uint8_t *cur, uint8_t *ref, unsigned int width) const
+	{
+		for (unsigned int x = 0; x < width; x++)
+		{
+			int diff = cur[x] - ref[x];
+			int excess = std::max(std::abs(diff) - low, 0);
+			int alpha = std::min(min_alpha + ((excess * slope) >> 8), 256);
+			uint8_t out = ref[x] + ((diff * alpha + 128) >> 8);
+			cur[x] = out;
+			ref[x] = out;
+		}
+	}
+};
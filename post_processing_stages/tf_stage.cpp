@@ -100,13 +100,11 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
 			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
-			BufferReadSync r(app_, completed_request->buffers[lores_stream_]);
-			libcamera::Span<uint8_t> buffer = r.Get()[0];
-
-			// Copy the lores image here and let the asynchronous thread convert it to RGB.
-			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
-			// memory into cached memory, which is then *much* quicker.
-			lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
+			// Grab the lores image here and let the asynchronous thread convert it to RGB.
+			// The cache holds a copy, which is in fact hugely beneficial because it turns
+			// uncached memory into cached memory, which is then *much* quicker. Other stages
+			// share the same copy (and RGB image, if they want the same size).
+			lores_cache_ = GetImageCache(completed_request, lores_stream_);
 
 			future_ = std::make_unique<std::future<void>>();
 			*future_ = std::async(std::launch::async, [this] {
@@ -127,9 +125,8 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 void TfStage::runInference()
 {
 	int input = interpreter_->inputs()[0];
-	StreamInfo tf_info;
-	tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
-	std::vector<uint8_t> rgb_image = Yuv420ToRgb(lores_copy_.data(), lores_info_, tf_info);
+	std::shared_ptr<const std::vector<uint8_t>> rgb = lores_cache_->Rgb(tf_w_, tf_h_);
+	const std::vector<uint8_t> &rgb_image = *rgb;
 
 	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
 	{
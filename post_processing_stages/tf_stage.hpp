@@ -21,6 +21,7 @@
 #include "core/libcamera_app.hpp"
 #include "core/stream_info.hpp"
 
+#include "post_processing_stages/image_cache.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 // The TfStage is a convenient base class from which post processing stages using
@@ -101,6 +102,6 @@ private:
 
 	std::mutex future_mutex_;
 	std::unique_ptr<std::future<void>> future_;
-	std::vector<uint8_t> lores_copy_;
+	std::shared_ptr<ImageCache> lores_cache_;
 	std::mutex output_mutex_;
 };
@@ -12,11 +12,14 @@
 # get a test in here.
 
 import argparse
+import http.client
 import json
 import os
 import os.path
+import socket
 import subprocess
 import sys
+import time
 from timeit import default_timer as timer
 import numpy as np
 
@@ -32,7 +35,7 @@ def check_exists(file, preamble):
         raise TestFailure(preamble + ": " + file + " not found")
 
 
-def clean_dir(dir, exts=('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', 'log.txt', 'timestamps.txt', 'metadata.json', 'metadata.txt')):
+def clean_dir(dir, exts=('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.mp4', '.raw', 'log.txt', 'timestamps.txt', 'metadata.json', 'metadata.txt')):
     for file in os.listdir(dir):
         if file.endswith(exts):
             os.remove(os.path.join(dir, file))
@@ -122,7 +125,7 @@ def check_size(file, limit, preamble):
         raise TestFailure(preamble + " failed, file " + file + " too small")
 
 
-def check_metadata(file, timestamp_file, preamble):
+def check_metadata(file, timestamp_file, preamble, all_frames=False):
     try:
         with open(timestamp_file) as f:
             times = np.loadtxt(f)
@@ -138,6 +141,9 @@ def check_metadata(file, timestamp_file, preamble):
     diffs = np.diff([x["SensorTimestamp"] for x in data]).astype(np.float64)
     t_diffs = np.diff(times)
     diffs /= 1000000
+    # Where frames may have been dropped the intervals vary, so check that every one lines up.
+    if all_frames and not np.allclose(diffs, t_diffs, atol=0.01):
+        raise TestFailure(preamble + " - metadata doesn't line up with the frames written")
     if not np.allclose(diffs[2:4], t_diffs[2:4], rtol=0.01):
         print(diffs[2:4], t_diffs[2:4])
         raise TestFailure(preamble + " - metadata times don't match timestamps")
@@ -299,6 +305,15 @@ def test_jpeg(exe_dir, output_dir):
     # For this one, we're actually going to peak inside the jpeg.
     check_jpeg(output_jpg, "test_jpeg: jpg test")
 
+    # "sliced jpg test". As above, but encode the image as slices in parallel.
+    print("    sliced jpg test")
+    retcode, time_taken = run_executable([executable, '-t', '1000', '-o', output_jpg,
+                                          '--jpeg-slices', '4'], logfile)
+    check_retcode(retcode, "test_jpeg: sliced jpg test")
+    check_time(time_taken, 1.2, 8, "test_jpeg: sliced jpg test")
+    check_size(output_jpg, 1024, "test_jpeg: sliced jpg test")
+    check_jpeg(output_jpg, "test_jpeg: sliced jpg test")
+
     # "isolation test". As above, but force IPA to run is "isolation" mode.
     # Disabled for now due to https://bugs.libcamera.org/show_bug.cgi?id=137
     #print("    isolation test")
@@ -374,6 +389,105 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: no-raw test")
     check_size(output_h264, 1024, "test_vid: no-raw test")
 
+    # "unbuffered test". As above, but writing the file synchronously.
+    print("    unbuffered test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264, '--output-buffer', '0'],
+                                         logfile)
+    check_retcode(retcode, "test_vid: unbuffered test")
+    check_time(time_taken, 2, 6, "test_vid: unbuffered test")
+    check_size(output_h264, 1024, "test_vid: unbuffered test")
+
+    # "rtp test". Stream to a local port as RTP, with small packets and pacing, and check
+    # how many packets and system calls were needed.
+    print("    rtp test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '-v', '2', '--mtu', '1000',
+                                          '--pacing', '20mbps', '-o', 'rtp://127.0.0.1:5004'],
+                                         logfile)
+    check_retcode(retcode, "test_vid: rtp test")
+    check_time(time_taken, 2, 6, "test_vid: rtp test")
+    log_text = open(logfile, 'r').read()
+    sent = [line for line in log_text.splitlines() if 'RTP packets' in line]
+    if not sent:
+        raise TestFailure("test_vid: rtp test - no RTP packets sent")
+    print("       ", sent[-1])
+
+    # "listen test". Serve the stream over TCP and connect two clients at different times.
+    # Both should start with the SPS, even though we're not asking for inline headers.
+    print("    listen test")
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '4000', '--listen', '-o', 'tcp://0.0.0.0:8554'],
+                             stdout=log, stderr=subprocess.STDOUT)
+        try:
+            received = []
+            for delay in (1.0, 1.0):
+                time.sleep(delay)
+                with socket.create_connection(('127.0.0.1', 8554), timeout=5) as s:
+                    data = b''
+                    while len(data) < 65536:
+                        chunk = s.recv(65536)
+                        if not chunk:
+                            break
+                        data += chunk
+                    received.append(data)
+        except OSError as e:
+            raise TestFailure("test_vid: listen test - " + str(e))
+        finally:
+            p.communicate()
+    check_retcode(p.returncode, "test_vid: listen test")
+    for data in received:
+        if len(data) < 1024 or data[:4] != b'\x00\x00\x00\x01' or (data[4] & 0x1f) != 7:
+            raise TestFailure("test_vid: listen test - client did not start with SPS")
+
+    # "http test". Serve MJPEG and H.264 over HTTP, as we might to a browser, and read the
+    # start of each stream.
+    print("    http test")
+    for codec, content_type, start in (('mjpeg', 'multipart/x-mixed-replace', b'--frame\r\n'),
+                                       ('h264', 'video/h264', b'\x00\x00\x00\x01')):
+        with open(logfile, 'w') as log:
+            p = subprocess.Popen([executable, '-t', '3000', '--codec', codec, '-o', 'http://0.0.0.0:8080'],
+                                 stdout=log, stderr=subprocess.STDOUT)
+            try:
+                time.sleep(1.0)
+                conn = http.client.HTTPConnection('127.0.0.1', 8080, timeout=5)
+                conn.request('GET', '/')
+                response = conn.getresponse()
+                data = response.read(65536)
+                conn.close()
+            except OSError as e:
+                raise TestFailure("test_vid: http test - " + str(e))
+            finally:
+                p.communicate()
+        check_retcode(p.returncode, "test_vid: http test")
+        if response.status != 200 or not response.getheader('Content-Type', '').startswith(content_type):
+            raise TestFailure("test_vid: http test - bad response for " + codec)
+        if len(data) < 1024 or not data.startswith(start):
+            raise TestFailure("test_vid: http test - bad " + codec + " stream")
+
+    # "control socket test". Send encoder commands while recording, including one that
+    # can't be understood, which should be reported without stopping the recording.
+    print("    control socket test")
+    control_socket = os.path.join(output_dir, 'control.sock')
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '3000', '-o', output_h264, '--control-socket', control_socket],
+                             stdout=log, stderr=subprocess.STDOUT)
+        try:
+            time.sleep(1.0)
+            with socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM) as s:
+                for command in (b'keyframe', b'bitrate 2mbps', b'nonsense'):
+                    s.sendto(command, control_socket)
+                    time.sleep(0.2)
+        except OSError as e:
+            raise TestFailure("test_vid: control socket test - " + str(e))
+        finally:
+            p.communicate()
+    check_retcode(p.returncode, "test_vid: control socket test")
+    check_size(output_h264, 1024, "test_vid: control socket test")
+    failed = [line for line in open(logfile, 'r').read().splitlines() if 'Encoder command failed' in line]
+    if len(failed) != 1 or 'nonsense' not in failed[0]:
+        raise TestFailure("test_vid: control socket test - commands not handled as expected")
+    if os.path.exists(control_socket):
+        raise TestFailure("test_vid: control socket test - socket was not removed")
+
     # "mjpeg test". As above, but write an mjpeg file.
     print("    mjpeg test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
@@ -383,6 +497,44 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: mjpeg test")
     check_size(output_mjpeg, 1024, "test_vid: mjpeg test")
 
+    # "mjpeg latency test". Encode at 60fps and report the output latency jitter.
+    print("    mjpeg latency test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg', '--framerate', '60',
+                                          '--width', '1280', '--height', '720', '-v', '2', '-o', output_mjpeg],
+                                         logfile)
+    check_retcode(retcode, "test_vid: mjpeg latency test")
+    check_time(time_taken, 2, 6, "test_vid: mjpeg latency test")
+    check_size(output_mjpeg, 1024, "test_vid: mjpeg latency test")
+    log_text = open(logfile, 'r').read()
+    latency = [line for line in log_text.splitlines() if 'latency mean' in line]
+    if not latency:
+        raise TestFailure("test_vid: mjpeg latency test - no latency statistics reported")
+    print("       ", latency[-1])
+
+    # "mjpeg slices test". Split each frame into slices and encode them on several threads.
+    print("    mjpeg slices test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
+                                          '--mjpeg-slices', '4', '--mjpeg-threads', '4', '-o', output_mjpeg],
+                                         logfile)
+    check_retcode(retcode, "test_vid: mjpeg slices test")
+    check_time(time_taken, 2, 6, "test_vid: mjpeg slices test")
+    check_size(output_mjpeg, 1024, "test_vid: mjpeg slices test")
+
+    # "libav latency test". As above, but through libx264 tuned for low latency.
+    print("    libav latency test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'libav',
+                                          '--libav-video-codec', 'libx264', '--libav-latency', 'low',
+                                          '--width', '1280', '--height', '720', '-v', '2', '-o', output_h264],
+                                         logfile)
+    check_retcode(retcode, "test_vid: libav latency test")
+    check_time(time_taken, 2, 6, "test_vid: libav latency test")
+    check_size(output_h264, 1024, "test_vid: libav latency test")
+    log_text = open(logfile, 'r').read()
+    latency = [line for line in log_text.splitlines() if 'latency mean' in line]
+    if not latency:
+        raise TestFailure("test_vid: libav latency test - no latency statistics reported")
+    print("       ", latency[-1])
+
     # "segment test". As above, write the output in single frame segements.
     print("    segment test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
@@ -401,6 +553,31 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: circular test")
     check_size(output_circular, 1024, "test_vid: circular test")
 
+    # "rendition test". Record full resolution h264 and a lores mjpeg rendition together.
+    print("    rendition test")
+    output_rendition = os.path.join(output_dir, 'rendition.mjpeg')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--lores-width', '320', '--lores-height', '240',
+                                          '--rendition', 'stream=lores,codec=mjpeg,output=' + output_rendition],
+                                         logfile)
+    check_retcode(retcode, "test_vid: rendition test")
+    check_time(time_taken, 2, 6, "test_vid: rendition test")
+    check_size(output_h264, 1024, "test_vid: rendition test")
+    check_size(output_rendition, 1024, "test_vid: rendition test")
+
+    # "lores h264 rendition test". The same the other way round, so that the h264 encoder
+    # gets a stream smaller than the main one.
+    print("    lores h264 rendition test")
+    output_rendition = os.path.join(output_dir, 'rendition.h264')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg', '-o', output_mjpeg,
+                                          '--lores-width', '320', '--lores-height', '240',
+                                          '--rendition', 'stream=lores,codec=h264,output=' + output_rendition],
+                                         logfile)
+    check_retcode(retcode, "test_vid: lores h264 rendition test")
+    check_time(time_taken, 2, 6, "test_vid: lores h264 rendition test")
+    check_size(output_mjpeg, 1024, "test_vid: lores h264 rendition test")
+    check_size(output_rendition, 1024, "test_vid: lores h264 rendition test")
+
     # "pause test". Should be no output file if we start 'paused'.
     print("    pause test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--inline',
@@ -429,6 +606,20 @@ def test_vid(exe_dir, output_dir):
     check_size(output_h264, 1024, "test_vid: metadata test")
     check_metadata(output_metadata, output_timestamps, "test_vid: metadata test")
 
+    # "metadata drop test". Make the encoder drop frames, and check that the metadata is still
+    # written for exactly the frames that were encoded.
+    print("    metadata drop test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--h264-input-buffers', '1', '--backpressure', 'drop',
+                                          '--save-pts', output_timestamps,
+                                          '--metadata', output_metadata], logfile)
+    check_retcode(retcode, "test_vid: metadata drop test")
+    check_time(time_taken, 2, 6, "test_vid: metadata drop test")
+    check_size(output_h264, 1024, "test_vid: metadata drop test")
+    check_metadata(output_metadata, output_timestamps, "test_vid: metadata drop test", all_frames=True)
+    if open(logfile, 'r').read().find('H264: dropped') < 0:
+        print("WARNING: test_vid: metadata drop test - no frames were dropped")
+
     # "metadata txt test". Check that the txt metadata file is written and looks sensible
     print("    metadata txt test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
@@ -458,6 +649,23 @@ def test_raw(exe_dir, output_dir):
     check_time(time_taken, 2, 8, "test_vid: raw test")
     check_size(output_raw, 1024, "test_vid: raw test")
 
+    # "output backend test". Write raw frames with each output backend and report the
+    # throughput. Run the tests with the output directory on tmpfs and on a real block
+    # device to compare them (direct I/O falls back to normal writes on tmpfs).
+    print("    output backend test")
+    for backend in (['stdio'], ['io_uring'], ['io_uring', '--output-direct', '--output-preallocate', '64']):
+        retcode, time_taken = run_executable([executable, '-t', '2000', '-v', '2', '-o', output_raw,
+                                              '--output-backend'] + backend,
+                                             logfile)
+        check_retcode(retcode, "test_vid: output backend test")
+        check_time(time_taken, 2, 8, "test_vid: output backend test")
+        check_size(output_raw, 1024, "test_vid: output backend test")
+        log_text = open(logfile, 'r').read()
+        throughput = [line for line in log_text.splitlines() if 'MB/s' in line]
+        if not throughput:
+            raise TestFailure("test_vid: output backend test - no throughput reported")
+        print("       ", ' '.join(backend) + ":", throughput[-1])
+
     print("libcamera-raw tests passed")
 
 
@@ -478,6 +686,143 @@ def test_post_processing(exe_dir, output_dir, json_dir):
     check_retcode(retcode, "test_post_processing: negate test")
     check_time(time_taken, 2, 8, "test_post_processing: negate test")
 
+    # "point ops test". Run a chain of per-pixel operations on the main image.
+    print("    point ops test")
+    executable = os.path.join(exe_dir, 'libcamera-hello')
+    check_exists(executable, 'post-processing')
+    json_file = os.path.join(json_dir, 'point_ops.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000',
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: point ops test")
+    check_time(time_taken, 2, 8, "test_post_processing: point ops test")
+
+    # "temporal denoise test". Denoise a short video.
+    print("    temporal denoise test")
+    executable = os.path.join(exe_dir, 'libcamera-vid')
+    check_exists(executable, 'post-processing')
+    output_h264 = os.path.join(output_dir, 'test.h264')
+    json_file = os.path.join(json_dir, 'temporal_denoise.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: temporal denoise test")
+    check_time(time_taken, 2, 8, "test_post_processing: temporal denoise test")
+    check_size(output_h264, 1024, "test_post_processing: temporal denoise test")
+    if open(logfile, 'r').read().find('TemporalDenoiseStage: filtered') < 0:  # relies on "verbose" being set in the JSON
+        raise TestFailure("test_post_processing: temporal denoise test - stage did not run")
+
+    # "denoise bitrate test". Encode a synthetic noisy sequence with libx264 with and without
+    # the temporal denoise filter, and check that the filter makes the output smaller.
+    print("    denoise bitrate test")
+    executable = os.path.join(exe_dir, 'denoise-bitrate')
+    if not os.path.isfile(executable):
+        print('WARNING: test_post_processing: denoise bitrate test - built without libav, skipping test')
+    else:
+        retcode, time_taken = run_executable([executable, '--frames', '60', '--noise', '6'], logfile)
+        check_retcode(retcode, "test_post_processing: denoise bitrate test")
+        log = open(logfile, 'r').read()
+        pos = log.find('reduction ')
+        if pos < 0:
+            raise TestFailure("test_post_processing: denoise bitrate test - no result reported")
+        reduction = float(log[pos + len('reduction '):].split('%')[0])
+        print("      bitrate reduction", reduction, "%")
+        if reduction <= 0:
+            raise TestFailure("test_post_processing: denoise bitrate test - output did not get smaller")
+
+    # "motion gate test". Only record when motion is detected (a static scene may legitimately
+    # produce no output at all).
+    print("    motion gate test")
+    executable = os.path.join(exe_dir, 'libcamera-vid')
+    check_exists(executable, 'post-processing')
+    output_h264 = os.path.join(output_dir, 'gate.h264')
+    json_file = os.path.join(json_dir, 'motion_detect.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--lores-width', '128', '--lores-height', '96',
+                                          '--post-process-file', json_file,
+                                          '--gate', 'motion_detect.result', '--gate-preroll', '3'],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: motion gate test")
+    check_time(time_taken, 2, 8, "test_post_processing: motion gate test")
+
+    # And again through the libav encoder, whose output isn't opened until a frame is encoded.
+    output_mp4 = os.path.join(output_dir, 'gate.mp4')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_mp4, '--codec', 'libav',
+                                          '--lores-width', '128', '--lores-height', '96',
+                                          '--post-process-file', json_file,
+                                          '--gate', 'motion_detect.result', '--gate-preroll', '3'],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: motion gate test (libav)")
+    check_time(time_taken, 2, 8, "test_post_processing: motion gate test (libav)")
+
+    # "privacy mask test". Blur some fixed regions of the image.
+    print("    privacy mask test")
+    executable = os.path.join(exe_dir, 'libcamera-hello')
+    check_exists(executable, 'post-processing')
+    json_file = os.path.join(json_dir, 'privacy_mask.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000',
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: privacy mask test")
+    check_time(time_taken, 2, 8, "test_post_processing: privacy mask test")
+
+    # "stabilise test". Run the stabiliser on a short video.
+    print("    stabilise test")
+    executable = os.path.join(exe_dir, 'libcamera-vid')
+    check_exists(executable, 'post-processing')
+    output_h264 = os.path.join(output_dir, 'test.h264')
+    json_file = os.path.join(json_dir, 'stabilise.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--lores-width', '320', '--lores-height', '240',
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: stabilise test")
+    check_time(time_taken, 2, 8, "test_post_processing: stabilise test")
+    check_size(output_h264, 1024, "test_post_processing: stabilise test")
+
+    # "scene detect test". Run the scene change detector while encoding.
+    print("    scene detect test")
+    executable = os.path.join(exe_dir, 'libcamera-vid')
+    check_exists(executable, 'post-processing')
+    output_h264 = os.path.join(output_dir, 'test.h264')
+    json_file = os.path.join(json_dir, 'scene_detect.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--lores-width', '320', '--lores-height', '240',
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: scene detect test")
+    check_time(time_taken, 2, 8, "test_post_processing: scene detect test")
+    check_size(output_h264, 1024, "test_post_processing: scene detect test")
+
+    # "encode roi test". Pass regions of interest to the encoder (which may ignore them).
+    print("    encode roi test")
+    executable = os.path.join(exe_dir, 'libcamera-vid')
+    check_exists(executable, 'post-processing')
+    output_h264 = os.path.join(output_dir, 'test.h264')
+    json_file = os.path.join(json_dir, 'encode_roi.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: encode roi test")
+    check_time(time_taken, 2, 8, "test_post_processing: encode roi test")
+    check_size(output_h264, 1024, "test_post_processing: encode roi test")
+
+    # And again through libx264, which turns the regions into quantiser offsets.
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--codec', 'libav', '--libav-video-codec', 'libx264',
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: encode roi test (libav)")
+    check_time(time_taken, 2, 8, "test_post_processing: encode roi test (libav)")
+    check_size(output_h264, 1024, "test_post_processing: encode roi test (libav)")
+
     # "hdr test". Take an HDR capture.
     print("    hdr test")
     executable = os.path.join(exe_dir, 'libcamera-still')
@@ -493,6 +838,27 @@ def test_post_processing(exe_dir, output_dir, json_dir):
     check_time(time_taken, 6, 12, "test_post_processing: hdr test")
     check_size(output_hdr, 1024, "test_post_processing: hdr test")
 
+    # "luma stats test". Check the statistics get calculated and written to the metadata file.
+    print("    luma stats test")
+    executable = os.path.join(exe_dir, 'libcamera-vid')
+    check_exists(executable, 'post-processing')
+    output_h264 = os.path.join(output_dir, 'test.h264')
+    output_metadata = os.path.join(output_dir, 'metadata.json')
+    json_file = os.path.join(json_dir, 'luma_stats.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--lores-width', '320', '--lores-height', '240',
+                                          '--metadata', output_metadata,
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: luma stats test")
+    check_time(time_taken, 2, 8, "test_post_processing: luma stats test")
+    if open(logfile, 'r').read().find('LumaStatsStage: mean') < 0:  # relies on "verbose" being set in the JSON
+        raise TestFailure("test_post_processing: luma stats test - stage did not run")
+    metadata = json.load(open(output_metadata, 'r'))
+    if not metadata or 'LumaHistogram' not in metadata[0]:
+        raise TestFailure("test_post_processing: luma stats test - no statistics in metadata file")
+
     # "sobel test". Try to run a stage that uses OpenCV.
     print("    sobel test")
     executable = os.path.join(exe_dir, 'libcamera-hello')